@@ -0,0 +1,272 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "utils.hpp"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <string>
+#include <sys/file.h>
+#include <vector>
+
+// XXH64 (https://github.com/Cyan4973/xxHash): hashes several GB/s, so keying a
+// cache entry by the whole source file costs far less than decoding it.
+const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t Rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t Read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t Read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t Xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime64_2;
+  return Rotl64(acc, 31) * kPrime64_1;
+}
+
+static inline uint64_t Xxh64Merge(uint64_t acc, uint64_t lane) {
+  acc ^= Xxh64Round(0, lane);
+  return acc * kPrime64_1 + kPrime64_4;
+}
+
+uint64_t Hash64(const void *data, size_t size, uint64_t seed = 0) {
+  auto p = static_cast<const unsigned char *>(data);
+  const unsigned char *end = p + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + kPrime64_1 + kPrime64_2, v2 = seed + kPrime64_2;
+    uint64_t v3 = seed, v4 = seed - kPrime64_1;
+    for (; end - p >= 32; p += 32) {
+      v1 = Xxh64Round(v1, Read64(p));
+      v2 = Xxh64Round(v2, Read64(p + 8));
+      v3 = Xxh64Round(v3, Read64(p + 16));
+      v4 = Xxh64Round(v4, Read64(p + 24));
+    }
+    h = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+    h = Xxh64Merge(h, v1);
+    h = Xxh64Merge(h, v2);
+    h = Xxh64Merge(h, v3);
+    h = Xxh64Merge(h, v4);
+  } else {
+    h = seed + kPrime64_5;
+  }
+  h += size;
+  for (; end - p >= 8; p += 8)
+    h = Rotl64(h ^ Xxh64Round(0, Read64(p)), 27) * kPrime64_1 + kPrime64_4;
+  if (end - p >= 4) {
+    h = Rotl64(h ^ (Read32(p) * kPrime64_1), 23) * kPrime64_2 + kPrime64_3;
+    p += 4;
+  }
+  for (; p < end; p++)
+    h = Rotl64(h ^ (*p * kPrime64_5), 11) * kPrime64_1;
+  h ^= h >> 33;
+  h *= kPrime64_2;
+  h ^= h >> 29;
+  h *= kPrime64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// Copies a whole file in the kernel (copy_file_range, a reflink where the
+// filesystem can), with a read/write loop as the fallback.
+static bool CopyWholeFile(const std::string &from, const std::string &to) {
+  int in = open(from.c_str(), O_RDONLY);
+  if (in < 0)
+    return false;
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+  bool succ = true;
+  ssize_t n;
+  while ((n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0) {
+  }
+  if (n < 0) {
+    // cross device or unsupported: start over through user space
+    succ = lseek(in, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0 &&
+           lseek(out, 0, SEEK_SET) == 0;
+    std::vector<char> buffer(1 << 20);
+    while (succ && (n = read(in, buffer.data(), buffer.size())) > 0) {
+      for (ssize_t done = 0; succ && done < n;) {
+        ssize_t w = write(out, buffer.data() + done, n - done);
+        succ = w > 0;
+        done += w;
+      }
+    }
+    succ = succ && n == 0;
+  }
+  close(in);
+  return close(out) == 0 && succ;
+}
+
+// Content addressed store of encoded results. An entry is keyed by the hash
+// of the source file's bytes combined with a string describing everything
+// else that shapes the output (scale, filter, crop, format, quality...), and
+// lives at `dir/ab/abcdef0123456789.ext`, sharded over 256 subdirectories by
+// the first key byte. The files' mtime doubles as the LRU clock: hits touch
+// it, and inserts drop the least recently used entries until the whole store
+// fits in `max_bytes` again. `dir/.usage` keeps a running byte count under an
+// flock, so an insert only walks the shards when that count crosses the
+// budget (or is missing). Entries are written to a unique temporary file and
+// published with rename(2), so concurrent processes and threads sharing a
+// directory only ever see complete files.
+class ResultCache {
+public:
+  ResultCache(const std::string &dir, size_t max_bytes)
+      : dir_(dir), max_bytes_(max_bytes) {}
+
+  // Key for `params` applied to the contents of `source`; 0 if it can't be
+  // read.
+  uint64_t Key(const std::string &source, const std::string &params) const {
+    MappedFile file(source);
+    if (!file.valid())
+      return 0;
+    uint64_t h = Hash64(file.data(), file.size());
+    return Hash64(params.data(), params.size(), h);
+  }
+
+  // Copies the entry for `key` to `dst`; false on a miss.
+  bool Fetch(uint64_t key, const std::string &dst) const {
+    std::string path = PathFor(key, dst);
+    if (access(path.c_str(), R_OK) != 0 || !CopyWholeFile(path, dst))
+      return false;
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0); // most recently used
+    return true;
+  }
+
+  // Stores a copy of the freshly written `dst` under `key`.
+  bool Insert(uint64_t key, const std::string &dst) const {
+    std::string path = PathFor(key, dst);
+    std::string shard = path.substr(0, path.find_last_of('/'));
+    mkdir(dir_.c_str(), 0755);
+    mkdir(shard.c_str(), 0755);
+    std::string tmp = shard + "/.tmpXXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+      return false;
+    fchmod(fd, 0644);
+    close(fd);
+    struct stat st, old;
+    if (!CopyWholeFile(dst, tmp) || stat(tmp.c_str(), &st) != 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+    const bool replaced = stat(path.c_str(), &old) == 0;
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return false;
+    }
+
+    int usage = open((dir_ + "/.usage").c_str(), O_RDWR | O_CREAT, 0644);
+    if (usage < 0)
+      return true; // no running count to keep: the next insert rescans
+    flock(usage, LOCK_EX);
+    long long total = ReadUsage(usage);
+    if (total >= 0)
+      total += st.st_size - (replaced ? old.st_size : 0);
+    if (total < 0 || static_cast<size_t>(total) > max_bytes_)
+      total = Evict();
+    WriteUsage(usage, total);
+    close(usage); // drops the lock
+    return true;
+  }
+
+private:
+  // the output extension is part of the name so entries stay recognizable
+  std::string PathFor(uint64_t key, const std::string &dst) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%02x/%016" PRIx64,
+             static_cast<unsigned>(key >> 56), key);
+    std::string ext;
+    size_t dot = dst.find_last_of('.');
+    if (dot != std::string::npos && dst.find('/', dot) == std::string::npos)
+      ext = dst.substr(dot);
+    return dir_ + "/" + name + ext;
+  }
+
+  // The running byte count, -1 if the file is empty or unreadable.
+  static long long ReadUsage(int fd) {
+    char text[32] = {};
+    long long total = -1;
+    if (pread(fd, text, sizeof(text) - 1, 0) > 0)
+      sscanf(text, "%lld", &total);
+    return total;
+  }
+
+  static void WriteUsage(int fd, long long total) {
+    char text[32];
+    int length = snprintf(text, sizeof(text), "%lld\n", total);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, text, length, 0) != length)
+      ftruncate(fd, 0); // unknown again, so the next insert rescans
+  }
+
+  // Walks every shard and drops the least recently used entries until the
+  // store fits; returns the bytes that remain.
+  long long Evict() const {
+    struct Entry {
+      struct timespec used;
+      size_t size;
+      std::string path;
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    for (int shard = 0; shard < 256; shard++) {
+      char name[4];
+      snprintf(name, sizeof(name), "%02x", shard);
+      std::string shard_dir = dir_ + "/" + name;
+      DIR *d = opendir(shard_dir.c_str());
+      if (!d)
+        continue;
+      while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] == '.')
+          continue; // ".", ".." and half written entries
+        std::string path = shard_dir + "/" + e->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+          continue;
+        entries.push_back(Entry{st.st_mtim, static_cast<size_t>(st.st_size),
+                                path});
+        total += st.st_size;
+      }
+      closedir(d);
+    }
+    if (total <= max_bytes_)
+      return total;
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) {
+                return a.used.tv_sec != b.used.tv_sec
+                           ? a.used.tv_sec < b.used.tv_sec
+                           : a.used.tv_nsec < b.used.tv_nsec;
+              });
+    for (const auto &entry : entries) {
+      if (total <= max_bytes_)
+        break;
+      if (unlink(entry.path.c_str()) == 0)
+        total -= entry.size;
+    }
+    return total;
+  }
+
+  std::string dir_;
+  size_t max_bytes_;
+};
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef FORMATS_H_
+#define FORMATS_H_
+
+#include "memory.hpp"
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Formats cheap enough to leave out of the timing picture: QOI, a lossless
+// single pass byte oriented codec (https://qoiformat.org), and binary
+// PGM/PPM/PAM, which are just a text header in front of raw samples.
+
+// ---- QOI ----
+
+const unsigned char kQoiOpIndex = 0x00; // 00xxxxxx
+const unsigned char kQoiOpDiff = 0x40;  // 01xxxxxx
+const unsigned char kQoiOpLuma = 0x80;  // 10xxxxxx
+const unsigned char kQoiOpRun = 0xc0;   // 11xxxxxx
+const unsigned char kQoiOpRGB = 0xfe;
+const unsigned char kQoiOpRGBA = 0xff;
+const unsigned char kQoiEnd[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+struct QoiPixel {
+  unsigned char r, g, b, a;
+  bool operator==(const QoiPixel &o) const {
+    return r == o.r && g == o.g && b == o.b && a == o.a;
+  }
+};
+
+static inline int QoiHash(const QoiPixel &p) {
+  return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+}
+
+static inline void PutBigEndian32(unsigned char *out, unsigned int v) {
+  out[0] = v >> 24;
+  out[1] = v >> 16;
+  out[2] = v >> 8;
+  out[3] = v;
+}
+
+static inline unsigned int GetBigEndian32(const unsigned char *in) {
+  return (unsigned int)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+}
+
+// Encodes interleaved 3 or 4 channel pixels, handing the output to
+// `sink(data, size)` in 64K pieces.
+template <typename Sink>
+bool QoiEncode(const unsigned char *pixels, int cols, int rows, int channels,
+               Sink sink) {
+  if (cols <= 0 || rows <= 0 || (channels != 3 && channels != 4))
+    return false;
+  const size_t kChunk = 1 << 16;
+  unsigned char buffer[kChunk + 16];
+  size_t used = 14;
+  memcpy(buffer, "qoif", 4);
+  PutBigEndian32(buffer + 4, cols);
+  PutBigEndian32(buffer + 8, rows);
+  buffer[12] = channels;
+  buffer[13] = 0; // sRGB with linear alpha
+
+  QoiPixel index[64] = {};
+  QoiPixel prev{0, 0, 0, 255};
+  int run = 0;
+  const size_t count = static_cast<size_t>(cols) * rows;
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char *in = pixels + i * channels;
+    QoiPixel px{in[0], in[1], in[2], channels == 4 ? in[3] : prev.a};
+    if (px == prev) {
+      if (++run == 62) {
+        buffer[used++] = kQoiOpRun | (run - 1);
+        run = 0;
+      }
+    } else {
+      if (run > 0) {
+        buffer[used++] = kQoiOpRun | (run - 1);
+        run = 0;
+      }
+      int hash = QoiHash(px);
+      if (index[hash] == px) {
+        buffer[used++] = kQoiOpIndex | hash;
+      } else {
+        index[hash] = px;
+        if (px.a == prev.a) {
+          signed char dr = px.r - prev.r, dg = px.g - prev.g,
+                      db = px.b - prev.b;
+          signed char dr_dg = dr - dg, db_dg = db - dg;
+          if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+              db <= 1) {
+            buffer[used++] =
+                kQoiOpDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+          } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 &&
+                     db_dg >= -8 && db_dg <= 7) {
+            buffer[used++] = kQoiOpLuma | (dg + 32);
+            buffer[used++] = (dr_dg + 8) << 4 | (db_dg + 8);
+          } else {
+            buffer[used++] = kQoiOpRGB;
+            buffer[used++] = px.r;
+            buffer[used++] = px.g;
+            buffer[used++] = px.b;
+          }
+        } else {
+          buffer[used++] = kQoiOpRGBA;
+          buffer[used++] = px.r;
+          buffer[used++] = px.g;
+          buffer[used++] = px.b;
+          buffer[used++] = px.a;
+        }
+      }
+    }
+    prev = px;
+    if (used >= kChunk) {
+      sink(buffer, used);
+      used = 0;
+    }
+  }
+  if (run > 0)
+    buffer[used++] = kQoiOpRun | (run - 1);
+  memcpy(buffer + used, kQoiEnd, sizeof(kQoiEnd));
+  used += sizeof(kQoiEnd);
+  sink(buffer, used);
+  return true;
+}
+
+// Decodes a QOI file to `channels` (3 or 4) interleaved bytes per pixel in an
+// AllocImageBuffer block; nullptr if the data is not a well formed QOI image.
+unsigned char *QoiDecode(const unsigned char *data, size_t size, int *cols,
+                         int *rows, int channels = 3) {
+  if (size < 14 + sizeof(kQoiEnd) || memcmp(data, "qoif", 4) != 0)
+    return nullptr;
+  unsigned int width = GetBigEndian32(data + 4);
+  unsigned int height = GetBigEndian32(data + 8);
+  if (width == 0 || height == 0 || data[12] < 3 || data[12] > 4 ||
+      static_cast<size_t>(width) * height > (size_t(1) << 32) / 4)
+    return nullptr;
+  const size_t count = static_cast<size_t>(width) * height;
+  auto pixels = AllocImageBuffer(count * channels);
+  if (!pixels)
+    return nullptr;
+
+  QoiPixel index[64] = {};
+  QoiPixel px{0, 0, 0, 255};
+  const unsigned char *in = data + 14;
+  const unsigned char *end = data + size - sizeof(kQoiEnd);
+  unsigned char *out = pixels;
+  int run = 0;
+  for (size_t i = 0; i < count; i++, out += channels) {
+    if (run > 0) {
+      run--;
+    } else if (in < end) {
+      int op = *in++;
+      if (op == kQoiOpRGB || op == kQoiOpRGBA) {
+        int n = op == kQoiOpRGB ? 3 : 4;
+        if (end - in < n)
+          break;
+        px.r = in[0];
+        px.g = in[1];
+        px.b = in[2];
+        if (n == 4)
+          px.a = in[3];
+        in += n;
+      } else if ((op & 0xc0) == kQoiOpIndex) {
+        px = index[op];
+      } else if ((op & 0xc0) == kQoiOpDiff) {
+        px.r += ((op >> 4) & 3) - 2;
+        px.g += ((op >> 2) & 3) - 2;
+        px.b += (op & 3) - 2;
+      } else if ((op & 0xc0) == kQoiOpLuma) {
+        if (in >= end)
+          break;
+        int dg = (op & 0x3f) - 32;
+        int second = *in++;
+        px.r += dg - 8 + (second >> 4);
+        px.g += dg;
+        px.b += dg - 8 + (second & 0x0f);
+      } else {
+        run = op & 0x3f;
+      }
+      index[QoiHash(px)] = px;
+    } else {
+      break;
+    }
+    out[0] = px.r;
+    out[1] = px.g;
+    out[2] = px.b;
+    if (channels == 4)
+      out[3] = px.a;
+  }
+  if (out != pixels + count * channels) {
+    FreeImageBuffer(pixels);
+    return nullptr;
+  }
+  *cols = width;
+  *rows = height;
+  return pixels;
+}
+
+// ---- PGM / PPM / PAM ----
+
+struct PnmHeader {
+  int cols{0}, rows{0};
+  int depth{0}; // samples per pixel
+  int maxval{0};
+  size_t offset{0}; // where the samples start
+};
+
+static bool PnmNextToken(const unsigned char *data, size_t size, size_t *pos,
+                         std::string *token) {
+  token->clear();
+  while (*pos < size) {
+    unsigned char c = data[*pos];
+    if (c == '#') {
+      while (*pos < size && data[*pos] != '\n')
+        ++*pos;
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      ++*pos;
+    } else {
+      break;
+    }
+  }
+  while (*pos < size && !isspace(data[*pos]))
+    token->push_back(data[(*pos)++]);
+  return !token->empty();
+}
+
+// A header number: decimal digits only, at most INT_MAX.
+static bool PnmNumber(const std::string &token, int *value) {
+  if (token.empty() || !isdigit(static_cast<unsigned char>(token[0])))
+    return false;
+  char *end;
+  errno = 0;
+  long parsed = strtol(token.c_str(), &end, 10);
+  if (*end != '\0' || errno == ERANGE || parsed > INT_MAX)
+    return false;
+  *value = static_cast<int>(parsed);
+  return true;
+}
+
+// Largest width or height accepted, far beyond any real image but small
+// enough that the sample count below cannot wrap.
+const int kMaxPnmSide = 1 << 24;
+
+// Parses a binary P5 (grey), P6 (RGB) or P7 (PAM) header.
+bool ParsePnmHeader(const unsigned char *data, size_t size,
+                    PnmHeader *header) {
+  if (size < 3 || data[0] != 'P' || data[1] < '5' || data[1] > '7')
+    return false;
+  size_t pos = 2;
+  std::string token;
+  if (data[1] == '7') {
+    while (PnmNextToken(data, size, &pos, &token) && token != "ENDHDR") {
+      std::string value;
+      if (!PnmNextToken(data, size, &pos, &value))
+        return false;
+      int *field = token == "WIDTH"    ? &header->cols
+                   : token == "HEIGHT" ? &header->rows
+                   : token == "DEPTH"  ? &header->depth
+                   : token == "MAXVAL" ? &header->maxval
+                                       : nullptr;
+      if (field && !PnmNumber(value, field))
+        return false;
+      if (token == "TUPLTYPE")
+        while (pos < size && data[pos] != '\n')
+          pos++; // the depth says all we need
+    }
+    if (token != "ENDHDR")
+      return false;
+  } else {
+    int values[3];
+    for (int &value : values) {
+      if (!PnmNextToken(data, size, &pos, &token) || !PnmNumber(token, &value))
+        return false;
+    }
+    header->cols = values[0];
+    header->rows = values[1];
+    header->maxval = values[2];
+    header->depth = data[1] == '6' ? 3 : 1;
+  }
+  // exactly one whitespace byte ends the header
+  if (pos >= size)
+    return false;
+  header->offset = pos + 1;
+  if (header->cols <= 0 || header->rows <= 0 || header->cols > kMaxPnmSide ||
+      header->rows > kMaxPnmSide || header->depth < 1 || header->depth > 4 ||
+      header->maxval <= 0 || header->maxval >= 65536)
+    return false;
+  // pixels times at most 8 bytes each still fits a size_t
+  const size_t pixels = static_cast<size_t>(header->cols) * header->rows;
+  if (pixels > SIZE_MAX / 8)
+    return false;
+  const size_t bytes = header->maxval > 255 ? 2 : 1;
+  return header->offset <= size &&
+         pixels * header->depth * bytes <= size - header->offset;
+}
+
+// Header for 8-bit samples: P5/P6 for 1 or 3 channels, P7 when `pam` is set
+// or for 2 or 4 channels. A comment pads it to a multiple of 64 bytes, so the
+// samples of a mapped file start as aligned as an AllocImageBuffer block.
+std::string PnmHeaderFor(int cols, int rows, int channels, bool pam) {
+  static const char *kTupleTypes[] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB",
+                                      "RGB_ALPHA"};
+  std::string size = std::to_string(cols) + " " + std::to_string(rows);
+  std::string magic, body;
+  if (!pam && (channels == 1 || channels == 3)) {
+    magic = channels == 3 ? "P6\n" : "P5\n";
+    body = size + "\n255\n";
+  } else {
+    magic = "P7\n";
+    body = "WIDTH " + std::to_string(cols) + "\nHEIGHT " +
+           std::to_string(rows) + "\nDEPTH " + std::to_string(channels) +
+           "\nMAXVAL 255\nTUPLTYPE " + kTupleTypes[channels - 1] +
+           "\nENDHDR\n";
+  }
+  size_t length = magic.size() + body.size();
+  size_t padded = RoundUp(length + 2, kImageAlign); // "#" and its newline
+  return magic + "#" + std::string(padded - length - 2, ' ') + "\n" + body;
+}
+
+#endif
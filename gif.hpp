@@ -0,0 +1,155 @@
+#ifndef GIF_H_
+#define GIF_H_
+
+#include "image.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "resize.hpp"
+#include "utils.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Every frame of an animated GIF, already composited onto the canvas by
+// stb_image and stored back to back as interleaved RGB.
+struct AnimatedImage {
+  int cols{0}, rows{0}, count{0};
+  unsigned char *data{nullptr}; // stb_image allocation
+  std::vector<int> delays;      // milliseconds per frame
+
+  RGBImage frame(int k) const {
+    return RGBImage{cols, rows, kChannels,
+                    data + static_cast<size_t>(k) * cols * rows * kChannels};
+  }
+};
+
+AnimatedImage LoadAnimatedGif(const std::string &filename) {
+  AnimatedImage anim;
+  MappedFile file(filename);
+  if (!file.valid() || file.size() > INT_MAX)
+    return anim;
+  int *delays = nullptr;
+  int channels;
+  anim.data = stbi_load_gif_from_memory(
+      file.data(), static_cast<int>(file.size()), &delays, &anim.cols,
+      &anim.rows, &anim.count, &channels, kChannels);
+  if (!anim.data) {
+    std::cerr << "error loading image " << filename << ": "
+              << stbi_failure_reason() << std::endl;
+    anim.count = 0;
+    return anim;
+  }
+  printf("image height: %d, width: %d, frames: %d\n", anim.rows, anim.cols,
+         anim.count);
+  anim.delays.assign(delays, delays + anim.count);
+  stbi_image_free(delays);
+  return anim;
+}
+
+void FreeAnimatedImage(AnimatedImage *anim) {
+  stbi_image_free(anim->data);
+  anim->data = nullptr;
+  anim->count = 0;
+}
+
+// Resizes `count` frames starting at `first` into `outputs`, all through the
+// same tables. The output rows of all frames are laid end to end and striped
+// over the workers, so short animations still fill every worker and long ones
+// get whole frames per worker.
+static void ResizeFramesInto(const AnimatedImage &anim, int first, int count,
+                             const ResizeTables &tables,
+                             const std::vector<unsigned char *> &outputs) {
+  const int rows = tables.resize_rows;
+  const size_t stride = static_cast<size_t>(tables.resize_cols) * kChannels;
+  ParallelStripes(count * rows, [&](int, int begin, int end) {
+    while (begin < end) {
+      const int k = begin / rows;
+      const int row_end = std::min(end, (k + 1) * rows) - k * rows;
+      const int row_begin = begin - k * rows;
+      ResizeRegion(anim.frame(first + k).data, tables.rows, tables.cols,
+                   row_begin, row_end, 0, tables.resize_cols,
+                   outputs[k] + row_begin * stride, stride);
+      begin = k * rows + row_end;
+    }
+  });
+}
+
+// Resizes (after `transform`) every frame of `anim` and writes them as
+// `<base>_000<ext>`, `<base>_001<ext>`... plus `<base>.ffconcat`, which keeps
+// the frame delays so `ffmpeg -i <base>.ffconcat out.gif` (or .mp4, .webp)
+// turns the sequence back into an animation. Frames go through in batches of
+// one per worker: the batch is resized in one parallel pass, then its frames
+// are encoded in parallel, each on one thread (a lone frame gets the parallel
+// encoder instead), and the batch buffers are reused, so memory stays bounded
+// however long the animation is.
+bool ResizeAnimation(const AnimatedImage &anim, float ratio,
+                     const SourceTransform &transform, const std::string &base,
+                     const std::string &ext) {
+  ResizeTables tables;
+  BuildTransformTables(anim.frame(0), ratio, transform, &tables);
+  printf("resize to: %d x %d\n", tables.resize_rows, tables.resize_cols);
+  const int batch = std::max(1, std::min(anim.count, WorkerThreads()));
+  const size_t frame_bytes = static_cast<size_t>(kChannels) *
+                             tables.resize_rows * tables.resize_cols;
+  std::vector<unsigned char *> outputs;
+  for (int k = 0; k < batch; k++) {
+    outputs.push_back(AllocImageBuffer(frame_bytes));
+    if (!outputs.back()) {
+      std::cerr << "out of memory for " << batch << " frames of "
+                << frame_bytes << " bytes" << std::endl;
+      for (auto output : outputs)
+        FreeImageBuffer(output);
+      return false;
+    }
+  }
+
+  auto frame_name = [&](int k) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%03d", k);
+    return base + suffix + ext;
+  };
+  std::atomic<bool> succ{true};
+  std::chrono::duration<double> resize_time{0};
+  for (int first = 0; first < anim.count && succ; first += batch) {
+    const int count = std::min(batch, anim.count - first);
+    auto start = std::chrono::steady_clock::now();
+    ResizeFramesInto(anim, first, count, tables, outputs);
+    resize_time += std::chrono::steady_clock::now() - start;
+    ParallelStripes(count, [&](int, int begin, int end) {
+      // pool workers live on, so the flag is only set for this pass
+      StbRunsInline() = count > 1;
+      for (int k = begin; k < end; k++) {
+        RGBImage out{tables.resize_cols, tables.resize_rows, kChannels,
+                     outputs[k]};
+        if (!StoreImage(out, frame_name(first + k)))
+          succ = false;
+      }
+      StbRunsInline() = false;
+    });
+  }
+  for (auto output : outputs)
+    FreeImageBuffer(output);
+  std::cout << ">>> resize " << anim.count << " frames by 5x: "
+            << static_cast<int>(resize_time.count() * 1000) << "ms"
+            << std::endl;
+
+  std::ofstream list(base + ".ffconcat");
+  list << "ffconcat version 1.0\n";
+  for (int k = 0; k < anim.count; k++) {
+    std::string name = frame_name(k);
+    name = name.substr(name.find_last_of('/') + 1);
+    // browsers show delays of 10ms or less as 100ms, so do the same
+    int delay = anim.delays[k] > 10 ? anim.delays[k] : 100;
+    list << "file '" << name << "'\nduration " << delay / 1000.0 << "\n";
+  }
+  if (!list) {
+    std::cerr << "error saving " << base << ".ffconcat" << std::endl;
+    return false;
+  }
+  return succ;
+}
+
+#endif
@@ -8,26 +8,500 @@
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
+#include "formats.hpp"
+#include "memory.hpp"
+#include "parallel.hpp"
 #include "utils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <strings.h>
 #include <string>
+#include <thread>
+#include <vector>
+
+// Set on threads that already are one of several concurrent encoders or
+// decoders, so stb's work on them stays on that thread instead of each one
+// starting a full set of workers of its own.
+static bool &StbRunsInline() {
+  static thread_local bool value = false;
+  return value;
+}
+
+// Lets stb_image spread restart intervals and color conversion over the same
+// workers as the resize.
+static void StbParallelFor(void *, stbi_parallel_task *task, void *arg,
+                           int count) {
+  if (StbRunsInline()) {
+    task(arg, 0, count);
+    return;
+  }
+  ParallelStripes(count, [&](int, int begin, int end) { task(arg, begin, end); });
+}
+
+static void UseParallelDecode() {
+  static bool registered = false;
+  if (!registered) {
+    stbi_set_parallel_for(StbParallelFor, nullptr);
+    registered = true;
+  }
+}
+
+// Same for the PNG writer's row filters and deflate bands. StoreImages calls
+// this from several threads at once, hence the static initializer.
+static void UseParallelEncode() {
+  static const bool registered =
+      (stbi_write_set_parallel_for(StbParallelFor, nullptr), true);
+  (void)registered;
+}
+
+static bool HasExtension(const std::string &filename, const std::string &ext) {
+  if (filename.size() < ext.size())
+    return false;
+  return strcasecmp(filename.c_str() + filename.size() - ext.size(),
+                    ext.c_str()) == 0;
+}
+
+// Moves decoded pixels into an aligned, huge page backed buffer for the
+// kernels and releases the decoder's copy.
+static RGBImage AdoptDecodedPixels(stbi_uc *data, int cols, int rows,
+                                   int channels) {
+  printf("image height: %d, width: %d\n", rows, cols);
+  size_t size = static_cast<size_t>(cols) * rows * channels;
+  auto pixels = AllocImageBuffer(size);
+  if (!pixels) {
+    std::cerr << "error loading image: out of memory for " << size
+              << " bytes" << std::endl;
+    stbi_image_free(data);
+    return RGBImage{0, 0, channels, nullptr};
+  }
+  memcpy(pixels, data, size);
+  stbi_image_free(data);
+  return RGBImage{cols, rows, channels, pixels};
+}
+
+// Binary PGM/PPM/PAM. 8-bit RGB files whose samples start 64 byte aligned, as
+// StoreImageMapped writes them, are never copied: the file is mapped
+// copy-on-write and the buffer header goes into the bytes in front of the
+// samples, so only that page gets duplicated and FreeImageBuffer unmaps the
+// file. Any other layout is converted to 8-bit RGB in one pass.
+static RGBImage LoadImagePnm(const std::string &filename) {
+  RGBImage img{0, 0, 3, nullptr};
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return img;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return img;
+  }
+  size_t length = st.st_size;
+  void *addr =
+      mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return img;
+  auto base = static_cast<unsigned char *>(addr);
+  PnmHeader header;
+  if (!ParsePnmHeader(base, length, &header)) {
+    munmap(addr, length);
+    return img;
+  }
+  printf("image height: %d, width: %d\n", header.rows, header.cols);
+  img.cols = header.cols;
+  img.rows = header.rows;
+  if (header.depth == 3 && header.maxval == 255 &&
+      header.offset % kImageAlign == 0) {
+    img.data = base + header.offset;
+    auto block = reinterpret_cast<ImageBufferHeader *>(img.data) - 1;
+    block->map_base = addr;
+    block->map_length = length;
+    madvise(img.data, length - header.offset, MADV_WILLNEED);
+    return img;
+  }
+
+  const size_t count = static_cast<size_t>(header.cols) * header.rows;
+  img.data = AllocImageBuffer(count * 3);
+  if (img.data) {
+    const unsigned char *in = base + header.offset;
+    const int wide = header.maxval > 255;
+    const int maxval = header.maxval;
+    for (size_t i = 0; i < count; i++) {
+      for (int c = 0; c < 3; c++) {
+        // grey expands to all three channels, alpha is dropped
+        size_t k = i * header.depth + (header.depth >= 3 ? c : 0);
+        int v = wide ? in[2 * k] << 8 | in[2 * k + 1] : in[k];
+        if (maxval != 255)
+          v = (std::min(v, maxval) * 255 + maxval / 2) / maxval;
+        img.data[i * 3 + c] = v;
+      }
+    }
+  }
+  munmap(addr, length);
+  return img;
+}
+
+static RGBImage LoadImageQoi(const std::string &filename) {
+  RGBImage img{0, 0, 3, nullptr};
+  MappedFile file(filename);
+  if (file.valid())
+    img.data = QoiDecode(file.data(), file.size(), &img.cols, &img.rows, 3);
+  if (img.data)
+    printf("image height: %d, width: %d\n", img.rows, img.cols);
+  return img;
+}
 
 RGBImage LoadImage(const std::string &filename) {
   int cols, rows, img_channels;
   int expected_channels = 3;
-  // expected 3 channels loaded from image
-  auto data = stbi_load(filename.c_str(), &cols, &rows, &img_channels,
-                        expected_channels);
-  printf("image height: %d, width: %d\n", rows, cols);
-  return RGBImage{cols, rows, expected_channels, data};
+  stbi_uc *data = nullptr;
+  // the light formats by extension, with stb_image as the fallback
+  if (HasExtension(filename, ".qoi") || HasExtension(filename, ".ppm") ||
+      HasExtension(filename, ".pgm") || HasExtension(filename, ".pnm") ||
+      HasExtension(filename, ".pam")) {
+    auto img = HasExtension(filename, ".qoi") ? LoadImageQoi(filename)
+                                              : LoadImagePnm(filename);
+    if (img.data)
+      return img;
+  }
+  UseParallelDecode();
+  // decode straight out of the page cache instead of copying the file
+  // through stdio buffers; fall back to stdio for anything mmap rejects
+  MappedFile file(filename);
+  if (file.valid() && file.size() <= INT_MAX) {
+    data = stbi_load_from_memory(file.data(), static_cast<int>(file.size()),
+                                 &cols, &rows, &img_channels,
+                                 expected_channels);
+  } else {
+    // expected 3 channels loaded from image
+    data = stbi_load(filename.c_str(), &cols, &rows, &img_channels,
+                     expected_channels);
+  }
+  if (!data) {
+    std::cerr << "error loading image " << filename << ": "
+              << stbi_failure_reason() << std::endl;
+    return RGBImage{0, 0, expected_channels, nullptr};
+  }
+  return AdoptDecodedPixels(data, cols, rows, expected_channels);
+}
+
+// Loads a source that is only going to be shrunk to at most
+// min_rows x min_cols. JPEGs are decoded at the smallest DCT scale (1/2, 1/4
+// or 1/8) that still covers that size, which skips most of the IDCT and
+// color conversion work; the resize then finishes the remaining fractional
+// scale. Everything else loads at full size.
+RGBImage LoadImageForSize(const std::string &filename, int min_rows,
+                          int min_cols) {
+  MappedFile file(filename);
+  int cols, rows, img_channels;
+  if (!file.valid() || file.size() > INT_MAX ||
+      !stbi_info_from_memory(file.data(), static_cast<int>(file.size()), &cols,
+                             &rows, &img_channels)) {
+    return LoadImage(filename);
+  }
+  int denom = 8;
+  while (denom > 1 && ((rows + denom - 1) / denom < min_rows ||
+                       (cols + denom - 1) / denom < min_cols))
+    denom /= 2;
+
+  int expected_channels = 3;
+  UseParallelDecode();
+  stbi_uc *data = stbi_load_from_memory_scaled(
+      file.data(), static_cast<int>(file.size()), &cols, &rows, &img_channels,
+      expected_channels, denom);
+  if (!data) {
+    std::cerr << "error loading image " << filename << ": "
+              << stbi_failure_reason() << std::endl;
+    return RGBImage{0, 0, expected_channels, nullptr};
+  }
+  return AdoptDecodedPixels(data, cols, rows, expected_channels);
+}
+
+// Decodes a YCbCr JPEG straight to its planes, keeping the file's chroma
+// subsampling, for jobs that go back out as JPEG and have no use for RGB.
+// Returns data == nullptr, without complaining, for anything else (not a
+// JPEG, grey, RGB or CMYK JPEGs); callers fall back to LoadImage.
+YCbCrImage LoadImageYCbCr(const std::string &filename) {
+  YCbCrImage img{0, 0, 1, 1, nullptr};
+  MappedFile file(filename);
+  if (!file.valid() || file.size() > INT_MAX)
+    return img;
+  int cols, rows;
+  stbi_ycbcr_planes planes;
+  UseParallelDecode();
+  if (!stbi_load_jpeg_ycbcr_from_memory(file.data(),
+                                        static_cast<int>(file.size()), &cols,
+                                        &rows, &planes, 1))
+    return img;
+  img.cols = cols;
+  img.rows = rows;
+  img.chroma_step_cols = planes.hs[1];
+  img.chroma_step_rows = planes.vs[1];
+  bool usable = planes.hs[0] == 1 && planes.vs[0] == 1 &&
+                planes.hs[2] == planes.hs[1] && planes.vs[2] == planes.vs[1];
+  if (usable) {
+    printf("image height: %d, width: %d\n", rows, cols);
+    img.data = AllocImageBuffer(img.size());
+    for (int k = 0; k < 3; k++) {
+      int plane_cols = k == 0 ? img.cols : img.chroma_cols();
+      int plane_rows = k == 0 ? img.rows : img.chroma_rows();
+      for (int row = 0; row < plane_rows; row++) {
+        memcpy(img.plane(k) + static_cast<size_t>(row) * plane_cols,
+               planes.data[k] + static_cast<size_t>(row) * planes.stride[k],
+               plane_cols);
+      }
+    }
+  }
+  for (int k = 0; k < 3; k++)
+    stbi_image_free(planes.raw[k]);
+  return img;
 }
 
-void StoreImage(RGBImage img, const std::string &filename) {
+// Collects encoder output in a large user-space buffer and hands it to the
+// kernel in few big write(2) calls instead of the encoder's 64 byte chunks.
+// With `direct` the file is opened O_DIRECT: full, page aligned buffers bypass
+// the page cache and only the unaligned tail goes through a buffered write.
+class BufferedFileWriter {
+public:
+  static const size_t kBlock = 4096;
+
+  explicit BufferedFileWriter(const std::string &filename, bool direct = false,
+                              size_t capacity = 8 << 20)
+      : capacity_((capacity + kBlock - 1) / kBlock * kBlock) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (direct) {
+      fd_ = open(filename.c_str(), flags | O_DIRECT, 0644);
+      direct_ = fd_ >= 0;
+    }
+    if (fd_ < 0)
+      fd_ = open(filename.c_str(), flags, 0644);
+    if (fd_ >= 0 && posix_memalign(reinterpret_cast<void **>(&buffer_), kBlock,
+                                   capacity_) != 0) {
+      buffer_ = nullptr;
+    }
+  }
+
+  ~BufferedFileWriter() { Close(); }
+
+  BufferedFileWriter(const BufferedFileWriter &) = delete;
+  BufferedFileWriter &operator=(const BufferedFileWriter &) = delete;
+
+  bool ok() const { return fd_ >= 0 && buffer_ && !failed_; }
+  size_t bytes_written() const { return written_ + used_; }
+
+  void Append(const void *data, size_t size) {
+    auto src = static_cast<const unsigned char *>(data);
+    while (size > 0 && ok()) {
+      size_t chunk = std::min(size, capacity_ - used_);
+      memcpy(buffer_ + used_, src, chunk);
+      used_ += chunk;
+      src += chunk;
+      size -= chunk;
+      if (used_ == capacity_)
+        Flush();
+    }
+  }
+
+  // Writes whatever is left and closes the file; returns false if any write
+  // along the way failed.
+  bool Close() {
+    if (fd_ < 0)
+      return false;
+    if (direct_ && used_ % kBlock != 0) {
+      // O_DIRECT needs block sized writes, finish the tail through the cache
+      fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+      direct_ = false;
+    }
+    if (used_ > 0)
+      Flush();
+    bool succ = ok();
+    close(fd_);
+    fd_ = -1;
+    free(buffer_);
+    buffer_ = nullptr;
+    return succ;
+  }
+
+  // stbi_write_func adapter; `context` is the writer itself.
+  static void Write(void *context, void *data, int size) {
+    static_cast<BufferedFileWriter *>(context)->Append(data, size);
+  }
+
+private:
+  void Flush() {
+    size_t done = 0;
+    while (done < used_) {
+      ssize_t n = write(fd_, buffer_ + done, used_ - done);
+      if (n <= 0) {
+        failed_ = true;
+        return;
+      }
+      done += n;
+    }
+    written_ += used_;
+    used_ = 0;
+  }
+
+  int fd_{-1};
+  bool direct_{false};
+  bool failed_{false};
+  unsigned char *buffer_{nullptr};
+  size_t capacity_;
+  size_t used_{0};
+  size_t written_{0};
+};
+
+// Encodes to an in-memory JPEG, for callers that ship the bytes somewhere other
+// than a local file.
+std::vector<unsigned char> EncodeImage(RGBImage img, int quality = 95) {
+  std::vector<unsigned char> out;
+  auto append = [](void *context, void *data, int size) {
+    auto vec = static_cast<std::vector<unsigned char> *>(context);
+    auto bytes = static_cast<unsigned char *>(data);
+    vec->insert(vec->end(), bytes, bytes + size);
+  };
+  if (!stbi_write_jpg_to_func(append, &out, img.cols, img.rows, img.channels,
+                              img.data, quality)) {
+    out.clear();
+  }
+  return out;
+}
+
+// Runs `encode(writer)` against `filename` and reports the throughput.
+template <typename Encode>
+static bool WriteEncoded(const std::string &filename, bool direct_io,
+                         Encode encode) {
   std::cerr << "save image " << filename << std::endl;
-  auto succ = stbi_write_jpg(filename.c_str(), img.cols, img.rows, img.channels,
-                             img.data, 95);
+  auto start = std::chrono::steady_clock::now();
+  BufferedFileWriter writer(filename, direct_io);
+  auto succ = writer.ok() && encode(&writer);
+  size_t bytes = writer.bytes_written();
+  succ = writer.Close() && succ;
   if (!succ) {
     std::cerr << "error saving image " << std::endl;
+    return false;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "wrote " << bytes << " bytes in " << elapsed.count() * 1000
+            << "ms (" << bytes / 1048576.0 / elapsed.count() << " MB/s)"
+            << std::endl;
+  return true;
+}
+
+bool StoreImageMapped(RGBImage img, const std::string &filename);
+
+// Picks the format from the extension: PNG, QOI, PPM/PGM/PAM (through
+// StoreImageMapped) or a quality 95 JPEG for anything else. Returns false if
+// the file could not be written.
+bool StoreImage(RGBImage img, const std::string &filename,
+                bool direct_io = false) {
+  if (HasExtension(filename, ".ppm") || HasExtension(filename, ".pgm") ||
+      HasExtension(filename, ".pam")) {
+    return StoreImageMapped(img, filename);
+  }
+  if (HasExtension(filename, ".qoi")) {
+    return WriteEncoded(filename, direct_io, [&](BufferedFileWriter *writer) {
+      return QoiEncode(img.data, img.cols, img.rows, img.channels,
+                       [&](const void *data, size_t size) {
+                         writer->Append(data, size);
+                       });
+    });
+  }
+  if (HasExtension(filename, ".png")) {
+    UseParallelEncode();
+    return WriteEncoded(filename, direct_io, [&](BufferedFileWriter *writer) {
+      return stbi_write_png_to_func(BufferedFileWriter::Write, writer,
+                                    img.cols, img.rows, img.channels, img.data,
+                                    0) != 0;
+    });
+  }
+  return WriteEncoded(filename, direct_io, [&](BufferedFileWriter *writer) {
+    return stbi_write_jpg_to_func(BufferedFileWriter::Write, writer, img.cols,
+                                  img.rows, img.channels, img.data, 95) != 0;
+  });
+}
+
+// Encodes the planes as they are, 4:2:0 when the chroma is 2x2 subsampled and
+// 4:4:4 when it is not subsampled; no color conversion on the way.
+bool StoreImageYCbCr(const YCbCrImage &img, const std::string &filename,
+                     bool direct_io = false) {
+  const bool subsampled =
+      img.chroma_step_cols == 2 && img.chroma_step_rows == 2;
+  if (!subsampled && (img.chroma_step_cols != 1 || img.chroma_step_rows != 1)) {
+    std::cerr << "error saving image: unsupported chroma subsampling"
+              << std::endl;
+    return false;
+  }
+  const unsigned char *planes[3] = {img.plane(0), img.plane(1), img.plane(2)};
+  const int strides[3] = {img.cols, img.chroma_cols(), img.chroma_cols()};
+  return WriteEncoded(filename, direct_io, [&](BufferedFileWriter *writer) {
+    return stbi_write_jpg_ycbcr_to_func(BufferedFileWriter::Write, writer,
+                                        img.cols, img.rows, planes, strides,
+                                        subsampled, 95) != 0;
+  });
+}
+
+// Encodes and writes several images at once, one thread per image. False if
+// any of them failed.
+bool StoreImages(const std::vector<RGBImage> &images,
+                 const std::vector<std::string> &filenames) {
+  std::atomic<bool> succ{true};
+  std::vector<std::thread> writers;
+  for (size_t i = 0; i < images.size() && i < filenames.size(); i++) {
+    writers.emplace_back([&, i] {
+      if (!StoreImage(images[i], filenames[i]))
+        succ = false;
+    });
+  }
+  for (auto &writer : writers)
+    writer.join();
+  return succ;
+}
+
+// Uncompressed output written through a shared mapping of the destination:
+// `.ppm`/`.pgm` files get a binary P6/P5 header and `.pam` a P7 one (padded so
+// LoadImagePnm can map the result back without a copy), anything else is
+// stored as headerless interleaved pixels. A `.ppm` needs 3 channels and a
+// `.pgm` 1; other images are refused rather than written without the header
+// the extension promises. The pixel block is a single memcpy into the page
+// cache.
+bool StoreImageMapped(RGBImage img, const std::string &filename) {
+  std::cerr << "save image " << filename << std::endl;
+  std::string header;
+  const bool pam = HasExtension(filename, ".pam");
+  const bool ppm = HasExtension(filename, ".ppm");
+  const bool pgm = HasExtension(filename, ".pgm");
+  if ((ppm && img.channels != 3) || (pgm && img.channels != 1)) {
+    std::cerr << "error saving image: " << img.channels
+              << " channels do not fit " << filename << std::endl;
+    return false;
+  }
+  if (pam || ppm || pgm)
+    header = PnmHeaderFor(img.cols, img.rows, img.channels, pam);
+  size_t payload = static_cast<size_t>(img.cols) * img.rows * img.channels;
+  size_t total = header.size() + payload;
+
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, total) != 0) {
+    std::cerr << "error saving image " << std::endl;
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  void *addr = mmap(nullptr, total, PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "error saving image " << std::endl;
+    return false;
   }
+  madvise(addr, total, MADV_SEQUENTIAL);
+  auto out = static_cast<unsigned char *>(addr);
+  memcpy(out, header.data(), header.size());
+  memcpy(out + header.size(), img.data, payload);
+  munmap(addr, total);
+  return true;
 }
 
 #endif
\ No newline at end of file
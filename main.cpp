@@ -1,28 +1,303 @@
+#include "cache.hpp"
+#include "gif.hpp"
 #include "image.hpp"
+#include "parallel.hpp"
+#include "pyramid.hpp"
 #include "resize.hpp"
+#include "stream.hpp"
+#include "tiles.hpp"
 #include "utils.hpp"
 #include <iostream>
 #include <string>
 #include <thread>
 
+static void Usage() {
+  std::cerr << "Usage: ./resize [options] image.jpg" << std::endl;
+  std::cerr << "  --threads N   worker threads (default: cgroup CPU quota)"
+            << std::endl;
+  std::cerr << "  --cpus LIST   restrict workers to a cpu list, e.g. 0-3,8"
+            << std::endl;
+  std::cerr << "  --no-smt      one worker per physical core" << std::endl;
+  std::cerr << "  --sizes LIST  write one rendition per WxH in a comma"
+            << " separated list instead of the 5x image" << std::endl;
+  std::cerr << "  --tiles dzi|xyz  cut the 5x image into 256x256 tiles"
+            << " instead of writing it whole" << std::endl;
+  std::cerr << "  --crop X,Y,W,H  crop the source before resizing" << std::endl;
+  std::cerr << "  --orient N    apply EXIF orientation N (1-8) before resizing"
+            << std::endl;
+  std::cerr << "  --pyramid     write the 2x reduction mip chain instead of"
+            << " the 5x image" << std::endl;
+  std::cerr << "  --ycbcr       resize JPEGs as YCbCr planes, skipping the RGB"
+            << " conversions" << std::endl;
+  std::cerr << "  --420         write the 5x image with 4:2:0 chroma, averaged"
+            << " while resizing" << std::endl;
+  std::cerr << "  --format EXT  output format: jpg (default), png, qoi, ppm"
+            << " or pam" << std::endl;
+  std::cerr << "  --png         same as --format png" << std::endl;
+  std::cerr << "  (an animated GIF is written as numbered 5x frames plus an"
+            << " ffconcat list)" << std::endl;
+  std::cerr << "  --stream      resize every frame of a Y4M stream (- reads"
+            << " stdin and writes stdout)" << std::endl;
+  std::cerr << "  --raw WxH     stream raw interleaved RGB frames of WxH"
+            << std::endl;
+  std::cerr << "  --cache DIR   reuse 5x results stored in DIR, keyed by the"
+            << " source bytes and options" << std::endl;
+  std::cerr << "  --cache-size MB  evict least recently used results beyond"
+            << " MB (default 1024)" << std::endl;
+}
+
+// Parses "640x480,320x240" into target sizes; empty on malformed input.
+static std::vector<TargetSize> ParseSizes(const std::string &list) {
+  std::vector<TargetSize> sizes;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    int cols = 0, rows = 0;
+    if (sscanf(list.substr(pos, end - pos).c_str(), "%dx%d", &cols, &rows) != 2 ||
+        cols <= 0 || rows <= 0)
+      return {};
+    sizes.push_back(TargetSize{rows, cols});
+    pos = end + 1;
+  }
+  return sizes;
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  // flags override the RESIZE_THREADS / RESIZE_CPUS / RESIZE_SMT environment
+  ThreadConfig config = GlobalThreadConfig();
+  std::string src_name;
+  std::vector<TargetSize> sizes;
+  bool pyramid = false;
+  std::string tiles;
+  SourceTransform transform;
+  bool transformed = false;
+  bool ycbcr = false;
+  bool subsample = false;
+  std::string format = "jpg";
+  std::string cache_dir;
+  bool stream = false;
+  FrameFormat raw;
+  size_t cache_mb = 1024;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == "--threads" && i + 1 < argc) {
+      config.threads = std::max(0, atoi(argv[++i]));
+    } else if (arg == "--cpus" && i + 1 < argc) {
+      config.cpus = ParseCpuList(argv[++i]);
+      cpu_set_t usable = ConfiguredCpuSet(config);
+      if (config.cpus.empty() || CPU_COUNT(&usable) == 0) {
+        std::cerr << "--cpus needs a cpu list naming CPUs this process may"
+                  << " use" << std::endl;
+        Usage();
+        return 0;
+      }
+    } else if (arg == "--sizes" && i + 1 < argc) {
+      sizes = ParseSizes(argv[++i]);
+      if (sizes.empty()) {
+        Usage();
+        return 0;
+      }
+    } else if (arg == "--tiles" && i + 1 < argc) {
+      tiles = argv[++i];
+      if (tiles != "dzi" && tiles != "xyz") {
+        Usage();
+        return 0;
+      }
+    } else if (arg == "--crop" && i + 1 < argc) {
+      ImageRect &crop = transform.crop;
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &crop.col, &crop.row, &crop.cols,
+                 &crop.rows) != 4) {
+        Usage();
+        return 0;
+      }
+      transformed = true;
+    } else if (arg == "--orient" && i + 1 < argc) {
+      SourceTransform orient = TransformForExifOrientation(atoi(argv[++i]));
+      orient.crop = transform.crop;
+      transform = orient;
+      transformed = true;
+    } else if (arg == "--pyramid") {
+      pyramid = true;
+    } else if (arg == "--ycbcr") {
+      ycbcr = true;
+    } else if (arg == "--420") {
+      subsample = true;
+    } else if (arg == "--format" && i + 1 < argc) {
+      format = argv[++i];
+      if (format != "jpg" && format != "png" && format != "qoi" &&
+          format != "ppm" && format != "pam") {
+        Usage();
+        return 0;
+      }
+    } else if (arg == "--png") {
+      format = "png";
+    } else if (arg == "--stream") {
+      stream = true;
+    } else if (arg == "--raw" && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &raw.cols, &raw.rows) != 2 ||
+          raw.cols <= 0 || raw.rows <= 0) {
+        Usage();
+        return 0;
+      }
+      stream = true;
+    } else if (arg == "--cache" && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (arg == "--cache-size" && i + 1 < argc) {
+      cache_mb = std::max(0, atoi(argv[++i]));
+    } else if (arg == "--no-smt") {
+      config.use_smt = false;
+    } else if (arg.compare(0, 2, "--") != 0 && src_name.empty()) {
+      src_name = arg;
+    } else {
+      Usage();
+      return 0;
+    }
+  }
+  if (src_name.empty()) {
     std::cerr << "Need 1 argument" << std::endl;
-    std::cerr << "Usage: ./resize image.jpg" << std::endl;
+    Usage();
     return 0;
   }
-  std::string src_name(argv[1]);
-  auto image = LoadImage(src_name);
+  SetThreadConfig(config);
+  int name_len = src_name.find_last_of('.');
   const float ratio = 5.f;
-  auto image_after_resize = ResizeImage(image, ratio);
 
-  int name_len = src_name.find_last_of('.');
-  std::string dst_name = src_name.substr(0, name_len) + std::string("_5x.jpg");
+  if (stream) {
+    std::string dst = src_name == "-"
+                          ? "-"
+                          : src_name.substr(0, name_len) +
+                                (raw.cols > 0 ? "_5x.rgb" : "_5x.y4m");
+    return ResizeFrameStream(src_name, dst, ratio, raw) ? 0 : 1;
+  }
+
+  const std::string ext = "." + format;
+  const bool jpeg = format == "jpg";
+  const std::string dst_name = src_name.substr(0, name_len) + "_5x" + ext;
+
+  // animated GIFs become a frame sequence; a single frame takes the usual path
+  if (HasExtension(src_name, ".gif") && sizes.empty() && !pyramid &&
+      tiles.empty()) {
+    auto anim = LoadAnimatedGif(src_name);
+    if (anim.count > 1) {
+      bool succ = ResizeAnimation(anim, ratio, transform,
+                                  src_name.substr(0, name_len) + "_5x", ext);
+      FreeAnimatedImage(&anim);
+      return succ ? 0 : 1;
+    }
+    FreeAnimatedImage(&anim);
+  }
+
+  // a single 5x output can come straight from the result cache; the key
+  // covers every option that changes its bytes
+  ResultCache cache(cache_dir, cache_mb << 20);
+  uint64_t cache_key = 0;
+  if (!cache_dir.empty() && sizes.empty() && !pyramid && tiles.empty()) {
+    char params[256];
+    snprintf(params, sizeof(params),
+             "scale=%g filter=bicubic format=%s quality=95 420=%d ycbcr=%d "
+             "crop=%d,%d,%d,%d flip=%d,%d rotate=%d",
+             ratio, format.c_str(), subsample, ycbcr, transform.crop.col,
+             transform.crop.row, transform.crop.cols, transform.crop.rows,
+             transform.flip_horizontal, transform.flip_vertical,
+             transform.rotate);
+    cache_key = cache.Key(src_name, params);
+    if (cache_key && cache.Fetch(cache_key, dst_name)) {
+      std::cerr << "cached result " << dst_name << std::endl;
+      return 0;
+    }
+  }
+  auto remember = [&](bool stored) {
+    if (stored && cache_key)
+      cache.Insert(cache_key, dst_name);
+    return stored;
+  };
+
+  if (ycbcr && sizes.empty() && !pyramid && tiles.empty() && !transformed &&
+      jpeg) {
+    auto planes = LoadImageYCbCr(src_name);
+    if (planes.data) {
+      auto planes_after_resize = ResizeImageYCbCr(planes, ratio, subsample);
+      bool stored = planes_after_resize.data &&
+                    remember(StoreImageYCbCr(planes_after_resize, dst_name));
+      FreeImageBuffer(planes.data);
+      FreeImageBuffer(planes_after_resize.data);
+      return stored ? 0 : 1;
+    }
+    std::cerr << "not a YCbCr JPEG, resizing as RGB" << std::endl;
+  }
+
+  RGBImage image;
+  if (!sizes.empty()) {
+    // only shrinking renditions: let the JPEG decoder do the coarse part
+    int max_rows = 0, max_cols = 0;
+    for (const auto &size : sizes) {
+      max_rows = std::max(max_rows, size.rows);
+      max_cols = std::max(max_cols, size.cols);
+    }
+    image = LoadImageForSize(src_name, max_rows, max_cols);
+  } else {
+    image = LoadImage(src_name);
+  }
+  if (!image.data)
+    return 1;
+
+  if (pyramid) {
+    auto chain = BuildPyramid(image);
+    std::vector<std::string> dst_names;
+    for (size_t k = 0; k < chain.levels.size(); k++) {
+      dst_names.push_back(src_name.substr(0, name_len) + "_mip" +
+                          std::to_string(k + 1) + ext);
+    }
+    bool stored = StoreImages(chain.levels, dst_names);
+    FreePyramid(&chain);
+    FreeImageBuffer(image.data);
+    return stored ? 0 : 1;
+  }
+
+  if (!sizes.empty()) {
+    auto renditions = ResizeImageMulti(image, sizes);
+    std::vector<std::string> dst_names;
+    for (const auto &size : sizes) {
+      dst_names.push_back(src_name.substr(0, name_len) + "_" +
+                          std::to_string(size.cols) + "x" +
+                          std::to_string(size.rows) + ext);
+    }
+    bool stored = StoreImages(renditions, dst_names);
+    for (const auto &rendition : renditions)
+      FreeImageBuffer(rendition.data);
+    FreeImageBuffer(image.data);
+    return stored ? 0 : 1;
+  }
+
+  if (!tiles.empty()) {
+    TileOptions options;
+    options.layout = tiles == "xyz" ? TileLayout::kXYZ : TileLayout::kDeepZoom;
+    bool succ = ResizeImageToTiles(image, ratio,
+                                   src_name.substr(0, name_len) + "_5x", options);
+    FreeImageBuffer(image.data);
+    return succ ? 0 : 1;
+  }
+
+  if (subsample && jpeg) {
+    auto planes_after_resize =
+        transformed ? ResizeImageTransformed420(image, ratio, transform)
+                    : ResizeImage420(image, ratio);
+    bool stored = planes_after_resize.data &&
+                  remember(StoreImageYCbCr(planes_after_resize, dst_name));
+    FreeImageBuffer(image.data);
+    FreeImageBuffer(planes_after_resize.data);
+    return stored ? 0 : 1;
+  }
+
+  auto image_after_resize = transformed
+                                ? ResizeImageTransformed(image, ratio, transform)
+                                : ResizeImage(image, ratio);
 
-  StoreImage(image_after_resize, dst_name);
+  bool stored = remember(StoreImage(image_after_resize, dst_name));
 
-  stbi_image_free(image.data);
-  stbi_image_free(image_after_resize.data);
-  return 0;
-}
\ No newline at end of file
+  FreeImageBuffer(image.data);
+  FreeImageBuffer(image_after_resize.data);
+  return stored ? 0 : 1;
+}
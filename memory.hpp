@@ -0,0 +1,88 @@
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+// Pixel buffers handed out by AllocImageBuffer are 64 byte aligned, so a row
+// start never splits an AVX-512 load, and come back zero filled. Anything of
+// huge page size or more is mapped directly: explicit MAP_HUGETLB pages when
+// the system has some reserved, otherwise a 2M aligned anonymous mapping
+// advised with MADV_HUGEPAGE so transparent huge pages can back it. Either way
+// a multi hundred MB output costs a few hundred page faults instead of tens of
+// thousands.
+
+const size_t kImageAlign = 64;
+const size_t kHugePageSize = 2 << 20;
+
+// Sits in the 64 bytes right before the pixel data and remembers how to
+// release the block.
+struct alignas(kImageAlign) ImageBufferHeader {
+  void *map_base;
+  size_t map_length; // 0 for heap blocks
+};
+
+static inline size_t RoundUp(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+static void *MapHugeBuffer(size_t length) {
+  void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (addr != MAP_FAILED)
+    return addr;
+
+  // no reserved huge pages; over-map so the block can start on a 2M boundary
+  // and give the unaligned head and tail back
+  size_t padded = length + kHugePageSize;
+  auto raw = static_cast<char *>(mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (raw == MAP_FAILED)
+    return nullptr;
+  auto base = reinterpret_cast<char *>(
+      RoundUp(reinterpret_cast<size_t>(raw), kHugePageSize));
+  if (base > raw)
+    munmap(raw, base - raw);
+  size_t tail = (raw + padded) - (base + length);
+  if (tail > 0)
+    munmap(base + length, tail);
+  madvise(base, length, MADV_HUGEPAGE);
+  return base;
+}
+
+unsigned char *AllocImageBuffer(size_t size) {
+  const size_t header = sizeof(ImageBufferHeader);
+  ImageBufferHeader *block = nullptr;
+  if (size + header >= kHugePageSize) {
+    size_t length = RoundUp(size + header, kHugePageSize);
+    void *base = MapHugeBuffer(length);
+    if (base) {
+      block = static_cast<ImageBufferHeader *>(base);
+      block->map_base = base;
+      block->map_length = length;
+    }
+  }
+  if (!block) {
+    void *mem = nullptr;
+    if (posix_memalign(&mem, kImageAlign, size + header) != 0)
+      return nullptr;
+    memset(mem, 0, size + header);
+    block = static_cast<ImageBufferHeader *>(mem);
+    block->map_base = mem;
+    block->map_length = 0;
+  }
+  return reinterpret_cast<unsigned char *>(block + 1);
+}
+
+void FreeImageBuffer(void *data) {
+  if (!data)
+    return;
+  auto block = static_cast<ImageBufferHeader *>(data) - 1;
+  if (block->map_length)
+    munmap(block->map_base, block->map_length);
+  else
+    free(block->map_base);
+}
+
+#endif
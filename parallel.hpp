@@ -0,0 +1,481 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A NUMA node as far as this process is concerned: the CPUs of the node that
+// are also in our affinity mask.
+struct NumaNode {
+  int id;
+  cpu_set_t cpus;
+  int cpu_count;
+};
+
+// Parses a cpu list such as "0-15,32-47" (sysfs or user supplied). Entries
+// must be plain numbers or ascending ranges; CPUs at or past CPU_SETSIZE are
+// dropped, since no cpu_set_t can hold them. Any malformed entry makes the
+// whole list empty.
+static std::vector<int> ParseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  auto number = [](const char *text, const char **end, long *value) {
+    if (!isdigit(static_cast<unsigned char>(*text)))
+      return false;
+    char *stop;
+    errno = 0;
+    *value = strtol(text, &stop, 10);
+    *end = stop;
+    return errno != ERANGE;
+  };
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string range = list.substr(pos, end - pos);
+    // sysfs lists end in a newline
+    while (!range.empty() && isspace(static_cast<unsigned char>(range.back())))
+      range.pop_back();
+    const char *text = range.c_str();
+    long first, last;
+    if (!number(text, &text, &first))
+      return {};
+    last = first;
+    if (*text == '-' && !number(text + 1, &text, &last))
+      return {};
+    if (*text != '\0' || last < first)
+      return {};
+    for (long cpu = first; cpu <= std::min<long>(last, CPU_SETSIZE - 1); cpu++)
+      cpus.push_back(static_cast<int>(cpu));
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+// How many workers to run and where. Zero threads means one per CPU the
+// container is actually entitled to: the cgroup CPU quota when there is one,
+// otherwise the usable CPUs in the affinity mask.
+struct ThreadConfig {
+  int threads{0};
+  std::vector<int> cpus; // empty: inherit the process affinity
+  bool use_smt{true};    // false: one hardware thread per physical core
+};
+
+// Defaults come from RESIZE_THREADS, RESIZE_CPUS (a cpu list like "0-3,8")
+// and RESIZE_SMT=0.
+static ThreadConfig ThreadConfigFromEnv() {
+  ThreadConfig config;
+  if (const char *threads = getenv("RESIZE_THREADS"))
+    config.threads = std::max(0, atoi(threads));
+  if (const char *cpus = getenv("RESIZE_CPUS")) {
+    config.cpus = ParseCpuList(cpus);
+    if (config.cpus.empty() && *cpus) {
+      std::cerr << "warning: ignoring malformed RESIZE_CPUS " << cpus
+                << std::endl;
+    }
+  }
+  if (const char *smt = getenv("RESIZE_SMT"))
+    config.use_smt = atoi(smt) != 0;
+  return config;
+}
+
+// Changes have to go through SetThreadConfig so the cached topology below is
+// rebuilt.
+ThreadConfig &GlobalThreadConfig() {
+  static ThreadConfig config = ThreadConfigFromEnv();
+  return config;
+}
+
+// CPUs granted by the cgroup CFS quota, rounded up; 0 when unlimited.
+static int CgroupCpuQuota() {
+  long quota = -1, period = 0;
+  std::ifstream v2("/sys/fs/cgroup/cpu.max");
+  std::string max;
+  if (v2 >> max >> period) {
+    if (max != "max")
+      quota = std::stol(max);
+  } else {
+    std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    if (!(quota_file >> quota && period_file >> period))
+      quota = -1;
+  }
+  if (quota <= 0 || period <= 0)
+    return 0;
+  return static_cast<int>((quota + period - 1) / period);
+}
+
+// The configured cpu list intersected with the process affinity (just the
+// affinity without a list). Empty when the list names no CPU we may run on.
+static cpu_set_t ConfiguredCpuSet(const ThreadConfig &config) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  if (!config.cpus.empty()) {
+    cpu_set_t wanted;
+    CPU_ZERO(&wanted);
+    for (int cpu : config.cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE)
+        CPU_SET(cpu, &wanted);
+    }
+    CPU_AND(&allowed, &allowed, &wanted);
+  }
+  return allowed;
+}
+
+// The CPUs workers may use: ConfiguredCpuSet, falling back to the process
+// affinity when that is empty, with all but the first hardware thread of each
+// core dropped when SMT is off.
+static cpu_set_t WorkerCpuSet(const ThreadConfig &config) {
+  cpu_set_t allowed = ConfiguredCpuSet(config);
+  if (CPU_COUNT(&allowed) == 0) {
+    std::cerr << "warning: no usable CPU in the configured cpu list, using "
+                 "the process affinity"
+              << std::endl;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+  }
+  if (!config.use_smt) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed))
+        continue;
+      std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                         "/topology/thread_siblings_list");
+      std::string list;
+      std::getline(file, list);
+      for (int sibling : ParseCpuList(list)) {
+        if (sibling != cpu && sibling < CPU_SETSIZE)
+          CPU_CLR(sibling, &allowed);
+      }
+    }
+  }
+  return allowed;
+}
+
+static std::vector<NumaNode> DetectNumaNodes(const cpu_set_t &allowed) {
+  std::vector<NumaNode> nodes;
+  const std::string root = "/sys/devices/system/node/";
+  if (DIR *dir = opendir(root.c_str())) {
+    while (dirent *entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+          name.find_first_not_of("0123456789", 4) != std::string::npos)
+        continue;
+      std::ifstream file(root + name + "/cpulist");
+      std::string list;
+      std::getline(file, list);
+      NumaNode node{std::stoi(name.substr(4)), {}, 0};
+      CPU_ZERO(&node.cpus);
+      for (int cpu : ParseCpuList(list)) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          CPU_SET(cpu, &node.cpus);
+          node.cpu_count++;
+        }
+      }
+      if (node.cpu_count > 0)
+        nodes.push_back(node);
+    }
+    closedir(dir);
+  }
+  if (nodes.empty()) {
+    // no NUMA information, everything is one node
+    nodes.push_back(NumaNode{0, allowed, CPU_COUNT(&allowed)});
+  }
+  return nodes;
+}
+
+inline void PinCurrentThread(const cpu_set_t &cpus) {
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+// The node a pool worker serves, -1 on every other thread.
+static int &WorkerNodeOfThread() {
+  static thread_local int node = -1;
+  return node;
+}
+
+// Long lived workers, a share of them pinned to every NUMA node, that run the
+// stripes of ParallelStripes calls. A call splits into numbered stripes that
+// are dealt to the nodes in proportion to their workers; each node keeps a
+// queue of calls with stripes left, and its workers take the next stripe of
+// the oldest one. The calling thread waits, unless it is a worker itself
+// (nested calls such as a parallel encoder inside a parallel job), in which
+// case it runs the unclaimed stripes of its own call so it can never wait on
+// workers that are all busy waiting too.
+class WorkerPool {
+public:
+  typedef void RunFn(void *ctx, int node, int stripe);
+
+  WorkerPool(const std::vector<NumaNode> &nodes, int workers)
+      : queues_(nodes.size()) {
+    int total_cpus = 0;
+    for (const auto &node : nodes)
+      total_cpus += node.cpu_count;
+    total_cpus = std::max(total_cpus, 1); // the last node takes every worker
+    int worker_begin = 0, cpus_before = 0;
+    for (size_t n = 0; n < nodes.size(); n++) {
+      cpus_before += nodes[n].cpu_count;
+      int worker_end = static_cast<long>(workers) * cpus_before / total_cpus;
+      if (n + 1 == nodes.size())
+        worker_end = workers;
+      queues_[n].workers = worker_end - worker_begin;
+      for (int w = worker_begin; w < worker_end; w++) {
+        const cpu_set_t cpus = nodes[n].cpus;
+        threads_.emplace_back([this, n, cpus] {
+          PinCurrentThread(cpus);
+          WorkerNodeOfThread() = static_cast<int>(n);
+          Work(static_cast<int>(n));
+        });
+      }
+      worker_begin = worker_end;
+    }
+  }
+
+  ~WorkerPool() {
+    for (auto &queue : queues_) {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.stop = true;
+      queue.ready.notify_all();
+    }
+    for (auto &thread : threads_)
+      thread.join();
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  int node_count() const { return static_cast<int>(queues_.size()); }
+  int workers(int node) const { return queues_[node].workers; }
+
+  // Runs `run(ctx, node, stripe)` for stripe in [0, stripes) and returns once
+  // all of them are done. Stripes dealt to a node stay in ascending order.
+  void Run(int stripes, RunFn *run, void *ctx) {
+    Job job;
+    job.run = run;
+    job.ctx = ctx;
+    job.remaining = stripes;
+    int total = static_cast<int>(threads_.size());
+    int stripe_begin = 0, workers_before = 0;
+    for (size_t n = 0; n < queues_.size(); n++) {
+      workers_before += queues_[n].workers;
+      int stripe_end = static_cast<long>(stripes) * workers_before / total;
+      job.next.push_back(stripe_begin);
+      job.end.push_back(stripe_end);
+      stripe_begin = stripe_end;
+    }
+    Execute(&job);
+  }
+
+  // Runs `run(ctx, node, node)` once on every node that has workers.
+  void RunOnEachNode(RunFn *run, void *ctx) {
+    Job job;
+    job.run = run;
+    job.ctx = ctx;
+    job.remaining = 0;
+    for (size_t n = 0; n < queues_.size(); n++) {
+      const int has_workers = queues_[n].workers > 0;
+      job.next.push_back(static_cast<int>(n));
+      job.end.push_back(static_cast<int>(n) + has_workers);
+      job.remaining += has_workers;
+    }
+    Execute(&job);
+  }
+
+private:
+  struct Job {
+    RunFn *run;
+    void *ctx;
+    std::vector<int> next, end; // per node, guarded by that node's queue
+    int remaining;              // stripes not finished yet
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Job *> jobs; // jobs with unclaimed stripes on this node
+    int workers{0};
+    bool stop{false};
+  };
+
+  void Execute(Job *job) {
+    for (size_t n = 0; n < queues_.size(); n++) {
+      if (job->end[n] > job->next[n]) {
+        Queue &queue = queues_[n];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+        queue.ready.notify_all();
+      }
+    }
+    if (WorkerNodeOfThread() >= 0) {
+      for (size_t n = 0; n < queues_.size(); n++) {
+        int stripe;
+        while (Claim(job, static_cast<int>(n), &stripe))
+          RunStripe(job, static_cast<int>(n), stripe);
+      }
+    }
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->done.wait(lock, [&] { return job->remaining == 0; });
+  }
+
+  // Takes the next stripe of `job` on `node`; the job leaves the node's queue
+  // with its last stripe, so it is never touched there after Run returns.
+  bool Claim(Job *job, int node, int *stripe) {
+    Queue &queue = queues_[node];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (job->next[node] >= job->end[node])
+      return false;
+    *stripe = job->next[node]++;
+    if (job->next[node] == job->end[node])
+      queue.jobs.erase(std::find(queue.jobs.begin(), queue.jobs.end(), job));
+    return true;
+  }
+
+  static void RunStripe(Job *job, int node, int stripe) {
+    job->run(job->ctx, node, stripe);
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (--job->remaining == 0)
+      job->done.notify_all();
+  }
+
+  void Work(int node) {
+    Queue &queue = queues_[node];
+    for (;;) {
+      Job *job;
+      int stripe;
+      {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.ready.wait(lock, [&] { return queue.stop || !queue.jobs.empty(); });
+        if (queue.jobs.empty())
+          return;
+        job = queue.jobs.front();
+        stripe = job->next[node]++;
+        if (job->next[node] == job->end[node])
+          queue.jobs.pop_front();
+      }
+      RunStripe(job, node, stripe);
+    }
+  }
+
+  std::vector<Queue> queues_;
+  std::vector<std::thread> threads_;
+};
+
+// What the current ThreadConfig resolves to: the nodes restricted to its CPUs,
+// the default worker count and the worker pool, started on first use. Built
+// once per configuration and never modified afterwards, so the many threads
+// entering ParallelStripes at once (parallel encoders inside StoreImages
+// writers, frame-parallel jobs) share it without locking; a configuration
+// change swaps in a new snapshot while running jobs keep the old one, whose
+// workers exit once the last of them is done. SetThreadConfig must therefore
+// not be called from inside a parallel task.
+struct WorkerTopology {
+  std::vector<NumaNode> nodes;
+  int workers;
+
+  WorkerPool &pool() const {
+    std::call_once(pool_once, [this] {
+      pool_.reset(new WorkerPool(nodes, workers));
+    });
+    return *pool_;
+  }
+
+private:
+  mutable std::once_flag pool_once;
+  mutable std::unique_ptr<WorkerPool> pool_;
+};
+
+static std::mutex &TopologyMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+static std::shared_ptr<const WorkerTopology> &CachedTopology() {
+  static std::shared_ptr<const WorkerTopology> topology;
+  return topology;
+}
+
+void SetThreadConfig(const ThreadConfig &config) {
+  std::lock_guard<std::mutex> lock(TopologyMutex());
+  GlobalThreadConfig() = config;
+  CachedTopology().reset();
+}
+
+// Sysfs and the cgroup files are only read again after SetThreadConfig.
+std::shared_ptr<const WorkerTopology> Topology() {
+  std::lock_guard<std::mutex> lock(TopologyMutex());
+  auto &topology = CachedTopology();
+  if (!topology) {
+    const ThreadConfig &config = GlobalThreadConfig();
+    auto built = std::make_shared<WorkerTopology>();
+    built->nodes = DetectNumaNodes(WorkerCpuSet(config));
+    if (config.threads > 0) {
+      built->workers = config.threads;
+    } else {
+      int cpus = 0;
+      for (const auto &node : built->nodes)
+        cpus += node.cpu_count;
+      int quota = CgroupCpuQuota();
+      if (quota > 0)
+        cpus = std::min(cpus, quota);
+      built->workers = std::max(cpus, 1);
+    }
+    topology = built;
+  }
+  return topology;
+}
+
+// Nodes restricted to the CPUs of the current ThreadConfig.
+std::shared_ptr<const std::vector<NumaNode>> NumaNodes() {
+  auto topology = Topology();
+  return std::shared_ptr<const std::vector<NumaNode>>(topology,
+                                                      &topology->nodes);
+}
+
+// Worker count for the current ThreadConfig.
+int WorkerThreads() { return Topology()->workers; }
+
+// Runs `fn(node, begin, end)` over [0, rows) split into `workers` stripes on
+// the worker pool. Stripes go to the NUMA nodes in proportion to their
+// workers, each node gets one contiguous run of them, and every worker is
+// pinned to its node, so output rows are first touched, and therefore placed,
+// on the node that computes them.
+template <class Fn>
+void ParallelStripes(int rows, Fn fn, int workers = WorkerThreads()) {
+  workers = std::max(1, std::min(workers, rows));
+  const auto topology = Topology();
+  auto stripe = [&](int node, int w) {
+    int begin = static_cast<long>(rows) * w / workers;
+    int end = static_cast<long>(rows) * (w + 1) / workers;
+    fn(node, begin, end);
+  };
+  topology->pool().Run(
+      workers,
+      [](void *ctx, int node, int w) {
+        (*static_cast<decltype(stripe) *>(ctx))(node, w);
+      },
+      &stripe);
+}
+
+// Runs `fn(node)` once on a worker of every NUMA node that has workers.
+template <class Fn> void ForEachNumaNode(Fn fn) {
+  const auto topology = Topology();
+  topology->pool().RunOnEachNode(
+      [](void *ctx, int node, int) { (*static_cast<Fn *>(ctx))(node); }, &fn);
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef PYRAMID_H_
+#define PYRAMID_H_
+
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "resize.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// A mip chain of successive 2x reductions. levels[k] is the source reduced by
+// 2^(k+1) in each direction (odd sizes round down, never below 1 pixel), and
+// all levels live back to back in the single buffer `data`, each level
+// starting on a 64 byte boundary. Release with FreePyramid.
+struct ImagePyramid {
+  unsigned char *data{nullptr};
+  std::vector<RGBImage> levels;
+};
+
+enum class PyramidSource {
+  kPreviousLevel, // each level is a 2:1 reduction of the one before it
+  kSource,        // each level averages 2^k x 2^k source blocks directly
+};
+
+// Averages `factor` x `factor` blocks of `src` into output rows [begin, end)
+// of `dst`. Blocks running off an odd edge reuse the last row / column.
+static void BoxReduce(const RGBImage &src, int factor, const RGBImage &dst,
+                      int begin, int end) {
+  // 64 bit: a block of 255s overflows 32 bits once factor passes 4096
+  const int64_t area = static_cast<int64_t>(factor) * factor;
+  std::vector<uint64_t> sums(static_cast<size_t>(dst.cols) * kChannels);
+  for (int i = begin; i < end; i++) {
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int di = 0; di < factor; di++) {
+      int row = std::min(i * factor + di, src.rows - 1);
+      const unsigned char *line =
+          src.data + static_cast<size_t>(row) * src.cols * kChannels;
+      for (int j = 0; j < dst.cols; j++) {
+        for (int dj = 0; dj < factor; dj++) {
+          int col = std::min(j * factor + dj, src.cols - 1);
+          for (int c = 0; c < kChannels; c++)
+            sums[j * kChannels + c] += line[col * kChannels + c];
+        }
+      }
+    }
+    unsigned char *out = dst.data + static_cast<size_t>(i) * dst.cols * kChannels;
+    for (int k = 0; k < dst.cols * kChannels; k++)
+      out[k] = (sums[k] + area / 2) / area;
+  }
+}
+
+// The common case of BoxReduce: one 2x2 block per output pixel, no
+// accumulator round trip.
+static void HalveRows(const RGBImage &src, const RGBImage &dst, int begin,
+                      int end) {
+  const size_t src_stride = static_cast<size_t>(src.cols) * kChannels;
+  const bool odd_cols = dst.cols * 2 > src.cols;
+  for (int i = begin; i < end; i++) {
+    const unsigned char *top = src.data + 2 * i * src_stride;
+    const unsigned char *bottom =
+        2 * i + 1 < src.rows ? top + src_stride : top;
+    unsigned char *out = dst.data + static_cast<size_t>(i) * dst.cols * kChannels;
+    int full = odd_cols ? dst.cols - 1 : dst.cols;
+    for (int k = 0; k < full * kChannels; k++) {
+      int j = k / kChannels * 2 * kChannels + k % kChannels;
+      out[k] = (top[j] + top[j + kChannels] + bottom[j] +
+                bottom[j + kChannels] + 2) >> 2;
+    }
+    for (int k = full * kChannels; k < dst.cols * kChannels; k++) {
+      int j = k / kChannels * 2 * kChannels + k % kChannels;
+      out[k] = (top[j] + bottom[j] + 1) >> 1;
+    }
+  }
+}
+
+// Builds up to `max_levels` levels (0: down to 1x1). Within a level the rows
+// are split over the worker threads; with PyramidSource::kSource the levels
+// do not depend on each other, so all of their rows go into one parallel run.
+ImagePyramid BuildPyramid(const RGBImage &src, int max_levels = 0,
+                          PyramidSource from = PyramidSource::kPreviousLevel) {
+  Timer timer("build image pyramid");
+  ImagePyramid pyramid;
+  std::vector<size_t> offsets;
+  size_t total = 0;
+  int rows = src.rows, cols = src.cols;
+  while ((rows > 1 || cols > 1) &&
+         (max_levels <= 0 || (int)pyramid.levels.size() < max_levels)) {
+    rows = std::max(1, rows / 2);
+    cols = std::max(1, cols / 2);
+    offsets.push_back(total);
+    total += RoundUp(static_cast<size_t>(rows) * cols * kChannels, kImageAlign);
+    pyramid.levels.push_back(RGBImage{cols, rows, kChannels, nullptr});
+  }
+  if (pyramid.levels.empty())
+    return pyramid;
+  pyramid.data = AllocImageBuffer(total);
+  for (size_t k = 0; k < pyramid.levels.size(); k++)
+    pyramid.levels[k].data = pyramid.data + offsets[k];
+
+  if (from == PyramidSource::kPreviousLevel) {
+    const RGBImage *prev = &src;
+    for (auto &level : pyramid.levels) {
+      ParallelStripes(level.rows, [&](int, int begin, int end) {
+        HalveRows(*prev, level, begin, end);
+      });
+      prev = &level;
+    }
+  } else {
+    // rows of all levels concatenated, so small levels do not serialize
+    std::vector<int> first_row;
+    int all_rows = 0;
+    for (const auto &level : pyramid.levels) {
+      first_row.push_back(all_rows);
+      all_rows += level.rows;
+    }
+    ParallelStripes(all_rows, [&](int, int begin, int end) {
+      for (size_t k = 0; k < pyramid.levels.size(); k++) {
+        int lo = std::max(begin, first_row[k]) - first_row[k];
+        int hi = std::min(end, first_row[k] + pyramid.levels[k].rows) -
+                 first_row[k];
+        if (lo < hi)
+          BoxReduce(src, 2 << k, pyramid.levels[k], lo, hi);
+      }
+    });
+  }
+  return pyramid;
+}
+
+void FreePyramid(ImagePyramid *pyramid) {
+  FreeImageBuffer(pyramid->data);
+  pyramid->data = nullptr;
+  pyramid->levels.clear();
+}
+
+#endif
@@ -1,13 +1,20 @@
 #ifndef RESIZE_H_
 #define RESIZE_H_
 
+#include "memory.hpp"
+#include "parallel.hpp"
 #include "utils.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
 #include <thread>
-#include "immintrin.h"
+#include <tuple>
 #include <vector>
 
-#define channels 3
+// interleaved RGB; kept out of the preprocessor so RGBImage::channels stays usable
+const int kChannels = 3;
 
 inline float WeightCoeff(float x,const float a) {
   if (x <= 1) {
@@ -21,196 +28,755 @@ inline float WeightCoeff(float x,const float a) {
   return 0.0;
 }
 
-static void CalcCoeff4x4(float x, float y, float *coeff) {
+// Bicubic weights are separable: the coefficient of output pixel (i, j) is the
+// product of a weight depending only on row i and one depending only on
+// column j. AxisWeights holds the taps of every output position along one
+// axis, as byte offsets into the source (already multiplied by the axis
+// stride and clamped to the image) and their weights. A table may cover only
+// a window of the output axis, starting at output position `first`. Taps are
+// clamped to the `src_len` samples starting at source index `origin`, walked
+// backwards when `reverse` is set, which is all a crop or a flip needs.
+// Output position i samples source position i / ratio + `shift`; the shift
+// lines up planes whose samples are sited differently (ChromaShift).
+//
+// Enlarging (and 1:1) uses the plain 4 tap kernel. When shrinking, the kernel
+// is stretched by 1 / ratio so it still covers every source sample between
+// neighbouring outputs: 2 * ceil(2 / ratio) taps weighted at their distance
+// times `ratio`, normalized to sum to one, instead of 4 taps that would skip
+// most of the source and alias.
+struct AxisWeights {
+  int length{0};
+  int taps{4};
+  std::vector<int> offset;
+  std::vector<float> weight;
+};
+
+static void BuildAxisWeights(int src_len, int dst_len, float ratio, int stride,
+                             AxisWeights *axis, int first = 0, int origin = 0,
+                             bool reverse = false, float shift = 0) {
   const float a = -0.5f;
-
-  float u = x - floor(x);
-  float v = y - floor(y);
-
-  u += 1;
-  v += 1;
-
-  float WCoeffU[16];
-  WCoeffU[0] = WCoeffU[1] = WCoeffU[2] = WCoeffU[3] = WeightCoeff(fabs(u - 0), a);
-  WCoeffU[4] = WCoeffU[5] = WCoeffU[6] = WCoeffU[7] = WeightCoeff(fabs(u - 1), a);
-  WCoeffU[8] = WCoeffU[9] = WCoeffU[10] = WCoeffU[11] = WeightCoeff(fabs(u - 2), a);
-  WCoeffU[12] = WCoeffU[13] = WCoeffU[14] = WCoeffU[15] = WeightCoeff(fabs(u - 3), a);
-  float WCoeffV[16];
-  WCoeffV[0] = WCoeffV[4] = WCoeffV[8] = WCoeffV[12] = WeightCoeff(fabs(v - 0), a);
-  WCoeffV[1] = WCoeffV[5] = WCoeffV[9] = WCoeffV[13] = WeightCoeff(fabs(v - 1), a);
-  WCoeffV[2] = WCoeffV[6] = WCoeffV[10] = WCoeffV[14] = WeightCoeff(fabs(v - 2), a);
-  WCoeffV[3] = WCoeffV[7] = WCoeffV[11] = WCoeffV[15] = WeightCoeff(fabs(v - 3), a);
-
-  /*//#pragma simd
-  for (int i = 0; i < 4; i++) {
-    for (int j = 0; j < 4; j++) {
-      coeff[i * 4 + j] = WCoeffU[i] * WCoeffV[j];
+  const bool shrink = ratio < 1;
+  const int half = shrink ? static_cast<int>(ceil(2 / ratio)) : 2;
+  const int taps = 2 * half;
+  axis->length = dst_len;
+  axis->taps = taps;
+  axis->offset.resize(static_cast<size_t>(taps) * dst_len);
+  axis->weight.resize(static_cast<size_t>(taps) * dst_len);
+  for (int i = 0; i < dst_len; i++) {
+    float pos = (first + i) / ratio + shift;
+    int base = floor(pos) - (half - 1);
+    float u = pos - floor(pos) + (half - 1);
+    int *offset = &axis->offset[static_cast<size_t>(taps) * i];
+    float *weight = &axis->weight[static_cast<size_t>(taps) * i];
+    float sum = 0;
+    for (int k = 0; k < taps; k++) {
+      int index = std::min(std::max(base + k, 0), src_len - 1);
+      if (reverse)
+        index = src_len - 1 - index;
+      offset[k] = (origin + index) * stride;
+      weight[k] = shrink ? WeightCoeff(fabs(u - k) * ratio, a)
+                         : WeightCoeff(fabs(u - k), a);
+      sum += weight[k];
+    }
+    if (shrink) {
+      for (int k = 0; k < taps; k++)
+        weight[k] /= sum;
     }
-  }*/
-  
-  //__m512 __WCoeffU = _mm512_set_ps(WCoeffU[0], WCoeffU[0], WCoeffU[0], WCoeffU[0], WCoeffU[1], WCoeffU[1], WCoeffU[1], WCoeffU[1], WCoeffU[2], WCoeffU[2], WCoeffU[2], WCoeffU[2], WCoeffU[3], WCoeffU[3], WCoeffU[3], WCoeffU[3]);
-  //__m512 __WCoeffV = _mm512_set_ps(WCoeffV[0], WCoeffV[0], WCoeffV[0], WCoeffV[0], WCoeffV[1], WCoeffV[1], WCoeffV[1], WCoeffV[1], WCoeffV[2], WCoeffV[2], WCoeffV[2], WCoeffV[2], WCoeffV[3], WCoeffV[3], WCoeffV[3], WCoeffV[3]);
+  }
+}
 
-  __m512 __WCoeffU = _mm512_load_ps(WCoeffU);
-  __m512 __WCoeffV = _mm512_load_ps(WCoeffV);
+// JPEG (and Y4M C420jpeg) sites a subsampled chroma sample at the centre of
+// the luma samples it covers, so chroma sample k of a plane subsampled by
+// `step` sits at luma position step * k + (step - 1) / 2. Luma position p of
+// the output maps to p / ratio in the source; going from output chroma sample
+// k to source chroma samples therefore takes k / chroma_ratio plus this shift,
+// in source chroma samples, for a source subsampled by `src_step` and an
+// output subsampled by `dst_step` along the axis.
+inline float ChromaShift(float ratio, int src_step, int dst_step) {
+  return (dst_step - 1) / (2.f * ratio * src_step) -
+         (src_step - 1) / (2.f * src_step);
+}
 
-  _mm512_store_ps(coeff,_mm512_mul_ps(__WCoeffU,__WCoeffV));
+struct ResizeTables {
+  int resize_rows{0}, resize_cols{0};
+  AxisWeights rows, cols;
+};
+
+static void BuildResizeTables(const RGBImage &src, float ratio,
+                              ResizeTables *tables) {
+  tables->resize_rows = src.rows * ratio;
+  tables->resize_cols = src.cols * ratio;
+  BuildAxisWeights(src.rows, tables->resize_rows, ratio,
+                   src.cols * kChannels, &tables->rows);
+  BuildAxisWeights(src.cols, tables->resize_cols, ratio, kChannels,
+                   &tables->cols);
+}
 
+// Computes output rows [row_begin, row_end) x columns [col_begin, col_end).
+// `dst` points at output pixel (row_begin, col_begin), rows `dst_stride` bytes
+// apart, so the same kernel fills whole images and standalone tiles. Pixels
+// are `Channels` interleaved bytes; 1 resizes a single sample plane. `Taps` is
+// the tap count of both tables when known at compile time, 0 reads it from
+// the tables.
+template <int Channels, int Taps>
+static void ResizeRegionTaps(const unsigned char *src, const AxisWeights &rows,
+                             const AxisWeights &cols, int row_begin,
+                             int row_end, int col_begin, int col_end,
+                             unsigned char *dst, size_t dst_stride) {
+  const int row_taps = Taps ? Taps : rows.taps;
+  const int col_taps = Taps ? Taps : cols.taps;
+  for (int i = row_begin; i < row_end; i++) {
+    const int *row_off = &rows.offset[static_cast<size_t>(row_taps) * i];
+    const float *row_w = &rows.weight[static_cast<size_t>(row_taps) * i];
+    unsigned char *out = dst + (i - row_begin) * dst_stride;
+    for (int j = col_begin; j < col_end; j++) {
+      const int *col_off = &cols.offset[static_cast<size_t>(col_taps) * j];
+      const float *col_w = &cols.weight[static_cast<size_t>(col_taps) * j];
+      float sumf[Channels] = {.0f};
+      for (int a = 0; a < row_taps; a++) {
+        const unsigned char *line = src + row_off[a];
+        float hsum[Channels] = {.0f};
+        for (int b = 0; b < col_taps; b++) {
+          const unsigned char *pixel = line + col_off[b];
+          for (int c = 0; c < Channels; c++)
+            hsum[c] += col_w[b] * pixel[c];
+        }
+        for (int c = 0; c < Channels; c++)
+          sumf[c] += row_w[a] * hsum[c];
+      }
+      for (int c = 0; c < Channels; c++) {
+        // bicubic overshoots around hard edges, saturate instead of wrapping
+        *out++ = static_cast<unsigned char>(
+            std::min(std::max(sumf[c], 0.f), 255.f));
+      }
+    }
+  }
 }
 
-static void BGRAfterBiCubic(RGBImage *src, float x_float, float y_float, unsigned char *sum, float *coeff) {
+template <int Channels = kChannels>
+static void ResizeRegion(const unsigned char *src, const AxisWeights &rows,
+                         const AxisWeights &cols, int row_begin, int row_end,
+                         int col_begin, int col_end, unsigned char *dst,
+                         size_t dst_stride) {
+  if (rows.taps == 4 && cols.taps == 4) {
+    ResizeRegionTaps<Channels, 4>(src, rows, cols, row_begin, row_end,
+                                  col_begin, col_end, dst, dst_stride);
+  } else {
+    ResizeRegionTaps<Channels, 0>(src, rows, cols, row_begin, row_end,
+                                  col_begin, col_end, dst, dst_stride);
+  }
+}
 
-  int x0 = floor(x_float) - 1;
-  int y0 = floor(y_float) - 1;
+void ResizeImagePart(const RGBImage *src, const ResizeTables *tables,
+                     int x_left, int x_right, int y_up, int y_down,
+                     unsigned char *res) {
+  size_t stride = static_cast<size_t>(tables->resize_cols) * kChannels;
+  ResizeRegion(src->data, tables->rows, tables->cols, x_left, x_right, y_up,
+               y_down, res + x_left * stride + y_up * kChannels, stride);
+}
 
-  float sumf[3] = {.0f};
-  #pragma simd
-  for (int i = 0; i < 4; i++) {
-    for (int j = 0; j < 4; j++) {
-      float temp = coeff[i * 4 + j];
-      int position = ((x0 + i) * src->cols + y0 + j) * channels;
-      sumf[0] += temp * src->data[position + 0];
-      sumf[1] += temp * src->data[position + 1];
-      sumf[2] += temp * src->data[position + 2];
+// On multi socket hosts every node reads its own copy of the (much smaller)
+// source, written by a thread on that node so it is placed there. On a single
+// node this is just the source pointer. Assign refills the copies for another
+// source and only allocates when they are too small, so a long lived instance
+// (ResizeContext) pays for the copy but not for the buffers.
+class SourceReplicas {
+public:
+  SourceReplicas() = default;
+  explicit SourceReplicas(const RGBImage &src) { Assign(src); }
+
+  ~SourceReplicas() { FreeCopies(); }
+
+  SourceReplicas(const SourceReplicas &) = delete;
+  SourceReplicas &operator=(const SourceReplicas &) = delete;
+
+  void Assign(const RGBImage &src) {
+    const size_t nodes = NumaNodes()->size();
+    replicas_.assign(nodes, src.data);
+    if (nodes <= 1)
+      return;
+    const size_t size = static_cast<size_t>(src.rows) * src.cols * src.channels;
+    if (copies_.size() != nodes || capacity_ < size) {
+      FreeCopies();
+      copies_.assign(nodes, nullptr);
+      capacity_ = size;
     }
+    ForEachNumaNode([&](int node) {
+      if (!copies_[node])
+        copies_[node] = AllocImageBuffer(capacity_);
+      // out of memory: this node reads the shared source instead
+      if (copies_[node]) {
+        memcpy(copies_[node], src.data, size);
+        replicas_[node] = copies_[node];
+      }
+    });
   }
 
-  /*__m128 row_0_coeff = _mm_load_ss(coeff);
-  __m128 row_1_coeff = _mm_load_ss(coeff+4);
-  __m128 row_2_coeff = _mm_load_ss(coeff+8);
-  __m128 row_3_coeff = _mm_load_ss(coeff+12);
-  int row0 = (x0 + 0) * src.cols + y0 ;
-  __m128 row_0_data_0 = _mm_set_ps((float)src.data[(row0 + 3) * channels + 0],(float)src.data[(row0 + 2) * channels + 0],(float)src.data[(row0 + 1) * channels + 0],(float)src.data[(row0 + 0) * channels + 0]);
-  __m128 row_0_data_1 = _mm_set_ps((float)src.data[(row0 + 3) * channels + 1],(float)src.data[(row0 + 2) * channels + 1],(float)src.data[(row0 + 1) * channels + 1],(float)src.data[(row0 + 0) * channels + 1]);
-  __m128 row_0_data_2 = _mm_set_ps((float)src.data[(row0 + 3) * channels + 2],(float)src.data[(row0 + 2) * channels + 2],(float)src.data[(row0 + 1) * channels + 2],(float)src.data[(row0 + 0) * channels + 2]);
-  int row1 = (x0 + 1) * src.cols + y0 ;
-  __m128 row_1_data_0 = _mm_set_ps((float)src.data[(row1 + 3) * channels + 0],(float)src.data[(row1 + 2) * channels + 0],(float)src.data[(row1 + 1) * channels + 0],(float)src.data[(row1 + 0) * channels + 0]);
-  __m128 row_1_data_1 = _mm_set_ps((float)src.data[(row1 + 3) * channels + 1],(float)src.data[(row1 + 2) * channels + 1],(float)src.data[(row1 + 1) * channels + 1],(float)src.data[(row1 + 0) * channels + 1]);
-  __m128 row_1_data_2 = _mm_set_ps((float)src.data[(row1 + 3) * channels + 2],(float)src.data[(row1 + 2) * channels + 2],(float)src.data[(row1 + 1) * channels + 2],(float)src.data[(row1 + 0) * channels + 2]);
-  int row2 = (x0 + 2) * src.cols + y0 ;
-  __m128 row_2_data_0 = _mm_set_ps((float)src.data[(row2 + 3) * channels + 0],(float)src.data[(row2 + 2) * channels + 0],(float)src.data[(row2 + 1) * channels + 0],(float)src.data[(row2 + 0) * channels + 0]);
-  __m128 row_2_data_1 = _mm_set_ps((float)src.data[(row2 + 3) * channels + 1],(float)src.data[(row2 + 2) * channels + 1],(float)src.data[(row2 + 1) * channels + 1],(float)src.data[(row2 + 0) * channels + 1]);
-  __m128 row_2_data_2 = _mm_set_ps((float)src.data[(row2 + 3) * channels + 2],(float)src.data[(row2 + 2) * channels + 2],(float)src.data[(row2 + 1) * channels + 2],(float)src.data[(row2 + 0) * channels + 2]);
-  int row3 = (x0 + 3) * src.cols + y0 ;
-  __m128 row_3_data_0 = _mm_set_ps((float)src.data[(row3 + 3) * channels + 0],(float)src.data[(row3 + 2) * channels + 0],(float)src.data[(row2 + 1) * channels + 0],(float)src.data[(row3 + 0) * channels + 0]);
-  __m128 row_3_data_1 = _mm_set_ps((float)src.data[(row3 + 3) * channels + 1],(float)src.data[(row3 + 2) * channels + 1],(float)src.data[(row2 + 1) * channels + 1],(float)src.data[(row3 + 0) * channels + 1]);
-  __m128 row_3_data_2 = _mm_set_ps((float)src.data[(row3 + 3) * channels + 2],(float)src.data[(row3 + 2) * channels + 2],(float)src.data[(row2 + 1) * channels + 2],(float)src.data[(row3 + 0) * channels + 2]);  
-  */
-  
-  /*__m512 __coeff = _mm512_load_ps(coeff);
-
-  int row0 = (x0 + 0) * src->cols + y0 ;
-  int row1 = (x0 + 1) * src->cols + y0 ;
-  int row2 = (x0 + 2) * src->cols + y0 ;
-  int row3 = (x0 + 3) * src->cols + y0 ;
-
-  __m512 __data_0 = _mm512_set_ps(src->data[(row3 + 3) * channels + 0],src->data[(row3 + 2) * channels + 0],src->data[(row2 + 1) * channels + 0],src->data[(row3 + 0) * channels + 0],(float)src->data[(row2 + 3) * channels + 0],src->data[(row2 + 2) * channels + 0],src->data[(row2 + 1) * channels + 0],src->data[(row2 + 0) * channels + 0],src->data[(row1 + 3) * channels + 0],src->data[(row1 + 2) * channels + 0],src->data[(row1 + 1) * channels + 0],src->data[(row1 + 0) * channels + 0],src->data[(row0 + 3) * channels + 0],src->data[(row0 + 2) * channels + 0],src->data[(row0 + 1) * channels + 0],src->data[(row0 + 0) * channels + 0]);
-  __m512 __data_1 = _mm512_set_ps(src->data[(row3 + 3) * channels + 1],src->data[(row3 + 2) * channels + 1],src->data[(row2 + 1) * channels + 1],src->data[(row3 + 0) * channels + 1],(float)src->data[(row2 + 3) * channels + 1],src->data[(row2 + 2) * channels + 1],src->data[(row2 + 1) * channels + 1],src->data[(row2 + 0) * channels + 1],src->data[(row1 + 3) * channels + 1],src->data[(row1 + 2) * channels + 1],src->data[(row1 + 1) * channels + 1],src->data[(row1 + 0) * channels + 1],src->data[(row0 + 3) * channels + 1],src->data[(row0 + 2) * channels + 1],src->data[(row0 + 1) * channels + 1],src->data[(row0 + 0) * channels + 1]);
-  __m512 __data_2 = _mm512_set_ps(src->data[(row3 + 3) * channels + 2],src->data[(row3 + 2) * channels + 2],src->data[(row2 + 1) * channels + 2],src->data[(row3 + 0) * channels + 2],(float)src->data[(row2 + 3) * channels + 2],src->data[(row2 + 2) * channels + 2],src->data[(row2 + 1) * channels + 2],src->data[(row2 + 0) * channels + 2],src->data[(row1 + 3) * channels + 2],src->data[(row1 + 2) * channels + 2],src->data[(row1 + 1) * channels + 2],src->data[(row1 + 0) * channels + 2],src->data[(row0 + 3) * channels + 2],src->data[(row0 + 2) * channels + 2],src->data[(row0 + 1) * channels + 2],src->data[(row0 + 0) * channels + 2]);*/
-  
-  /*//_mm_mul_ss
-  __m128 row_0_sum_0 = _mm_mul_ss(row_0_coeff, row_0_data_0);
-  __m128 row_0_sum_1 = _mm_mul_ss(row_0_coeff, row_0_data_1);
-  __m128 row_0_sum_2 = _mm_mul_ss(row_0_coeff, row_0_data_2);
-  __m128 row_1_sum_0 = _mm_mul_ss(row_1_coeff, row_1_data_0);
-  __m128 row_1_sum_1 = _mm_mul_ss(row_1_coeff, row_1_data_1);
-  __m128 row_1_sum_2 = _mm_mul_ss(row_1_coeff, row_1_data_2);
-  __m128 row_2_sum_0 = _mm_mul_ss(row_2_coeff, row_2_data_0);
-  __m128 row_2_sum_1 = _mm_mul_ss(row_2_coeff, row_2_data_1);
-  __m128 row_2_sum_2 = _mm_mul_ss(row_2_coeff, row_2_data_2);
-  __m128 row_3_sum_0 = _mm_mul_ss(row_3_coeff, row_3_data_0);
-  __m128 row_3_sum_1 = _mm_mul_ss(row_3_coeff, row_3_data_1);
-  __m128 row_3_sum_2 = _mm_mul_ss(row_3_coeff, row_3_data_2);*/
-  //_mm512_mul_ps
-
-  /*__m512 __sum_0 = _mm512_mul_ps(__coeff,__data_0);
-  __m512 __sum_1 = _mm512_mul_ps(__coeff,__data_1);
-  __m512 __sum_2 = _mm512_mul_ps(__coeff,__data_2);*/
-
-  /*sum[0] = static_cast<unsigned char>(row_0_sum_0[0]+row_0_sum_0[1]+row_0_sum_0[2]+row_0_sum_0[3]+row_1_sum_0[0]+row_1_sum_0[1]+row_1_sum_0[2]+row_1_sum_0[3]+row_2_sum_0[0]+row_2_sum_0[1]+row_2_sum_0[2]+row_2_sum_0[3]+row_3_sum_0[0]+row_3_sum_0[1]+row_3_sum_0[2]+row_3_sum_0[3]);
-  sum[1] = static_cast<unsigned char>(row_0_sum_1[0]+row_0_sum_1[1]+row_0_sum_1[2]+row_0_sum_1[3]+row_1_sum_1[0]+row_1_sum_1[1]+row_1_sum_1[2]+row_1_sum_1[3]+row_2_sum_1[0]+row_2_sum_1[1]+row_2_sum_1[2]+row_2_sum_1[3]+row_3_sum_1[0]+row_3_sum_1[1]+row_3_sum_1[2]+row_3_sum_1[3]);
-  sum[2] = static_cast<unsigned char>(row_0_sum_2[0]+row_0_sum_2[1]+row_0_sum_2[2]+row_0_sum_2[3]+row_1_sum_2[0]+row_1_sum_2[1]+row_1_sum_2[2]+row_1_sum_2[3]+row_2_sum_2[0]+row_2_sum_2[1]+row_2_sum_2[2]+row_2_sum_2[3]+row_3_sum_2[0]+row_3_sum_2[1]+row_3_sum_2[2]+row_3_sum_2[3]);*/
-  sum[0] = static_cast<unsigned char>(sumf[0]);
-  sum[1] = static_cast<unsigned char>(sumf[1]);
-  sum[2] = static_cast<unsigned char>(sumf[2]);
-
-  //sum[0] = static_cast<unsigned char>(__sum_0[0] + __sum_0[1] +__sum_0[2] +__sum_0[3] +__sum_0[4] +__sum_0[5] +__sum_0[6] +__sum_0[7] +__sum_0[8] +__sum_0[9] +__sum_0[10] +__sum_0[11] +__sum_0[12] +__sum_0[13] +__sum_0[14] +__sum_0[15]);
-  //sum[1] = static_cast<unsigned char>(__sum_1[0] + __sum_1[1] +__sum_1[2] +__sum_1[3] +__sum_1[4] +__sum_1[5] +__sum_1[6] +__sum_1[7] +__sum_1[8] +__sum_1[9] +__sum_1[10] +__sum_1[11] +__sum_1[12] +__sum_1[13] +__sum_1[14] +__sum_1[15]);
-  //sum[2] = static_cast<unsigned char>(__sum_2[0] + __sum_2[1] +__sum_2[2] +__sum_2[3] +__sum_2[4] +__sum_2[5] +__sum_2[6] +__sum_2[7] +__sum_2[8] +__sum_2[9] +__sum_2[10] +__sum_2[11] +__sum_2[12] +__sum_2[13] +__sum_2[14] +__sum_2[15]);
-
-  /*sum[0] = static_cast<unsigned char>(_mm512_reduce_add_ps(__sum_0));
-  sum[1] = static_cast<unsigned char>(_mm512_reduce_add_ps(__sum_1));
-  sum[2] = static_cast<unsigned char>(_mm512_reduce_add_ps(__sum_2));*/
-
-  return ;
-}
-
-
-//void ResizeImageThread(RGBImage src, int i, int j, int src_x, int src_y, int channels, int thischannel, unsigned char *res, float *coeff){
-//  int resize_cols = src.cols * 5.f;
-// res[((i * resize_cols) + j) * channels + thischannel] = BGRAfterBiCubic(src, src_x, src_y, channels, thischannel, coeff);
-//  return;
-//}
-
-void ResizeImagePart(RGBImage *src, float ratio, int x_left, int x_right, int y_up, int y_down, unsigned char *res) {
-//  static const int resize_rows = src.rows * ratio;
-//  static const int resize_cols = src.cols * ratio;
-  const int resize_cols = src->cols * ratio;
-  //auto check_perimeter = [src](float x, float y) -> bool {
-  //  return x < src.rows - 2 && x > 1 && y < src.cols - 2 && y > 1;
-  //};
-//  Timer part("Worker");
-  float coeff[16];
-  unsigned char sum[3];
-  if(x_left == 0) x_left += 2;
-  if(y_up == 0) y_up += 2;
-  if(x_right/ratio == src->rows) x_right -= 2;
-  if(y_down/ratio == src->cols) y_down -= 2;
-  for (int i = x_left; i < x_right; i++) {
-    for (int j = y_up; j < y_down; j++) {
-      float src_x = i / ratio;
-      float src_y = j / ratio;
-      //if (check_perimeter(src_x, src_y)) {
-        CalcCoeff4x4(src_x, src_y, coeff);
-        /*std::thread worker0(ResizeImageThread, src, i, j, src_x, src_y, channels, 0, res, coeff);
-        std::thread worker1(ResizeImageThread, src, i, j, src_x, src_y, channels, 1, res, coeff);
-        std::thread worker2(ResizeImageThread, src, i, j, src_x, src_y, channels, 2, res, coeff);
-        worker0.join();
-        worker1.join();
-        worker2.join();*/
-        BGRAfterBiCubic(src, src_x, src_y, sum, coeff);
-        res[((i * resize_cols) + j) * channels + 0] = sum[0];
-        res[((i * resize_cols) + j) * channels + 1] = sum[1];
-        res[((i * resize_cols) + j) * channels + 2] = sum[2];
-      //}
-    }
+  // a node past the end (the configuration changed since) reads the last copy
+  const unsigned char *operator[](int node) const {
+    return replicas_[std::min<size_t>(node, replicas_.size() - 1)];
+  }
+
+private:
+  void FreeCopies() {
+    for (auto copy : copies_)
+      FreeImageBuffer(copy);
+    copies_.clear();
+    capacity_ = 0;
   }
-  return ;
+
+  std::vector<const unsigned char *> replicas_;
+  std::vector<unsigned char *> copies_; // per node, allocated on that node
+  size_t capacity_{0};
+};
+
+static void ResizeInto(const SourceReplicas &replicas,
+                       const ResizeTables &tables, unsigned char *res) {
+  const int resize_rows = tables.resize_rows;
+  const int resize_cols = tables.resize_cols;
+  const size_t stride = static_cast<size_t>(resize_cols) * kChannels;
+
+  ParallelStripes(resize_rows, [&](int node, int begin, int end) {
+    ResizeRegion(replicas[node], tables.rows, tables.cols, begin, end, 0,
+                 resize_cols, res + begin * stride, stride);
+  });
 }
 
 RGBImage ResizeImage(RGBImage src, float ratio) {
   Timer timer("resize image by 5x");
-  const int resize_rows = src.rows * ratio ;
-  const int resize_cols = src.cols * ratio ;
+  ResizeTables tables;
+  BuildResizeTables(src, ratio, &tables);
+  const int resize_rows = tables.resize_rows;
+  const int resize_cols = tables.resize_cols;
 
   printf("resize to: %d x %d\n", resize_rows, resize_cols);
 
-  auto res = new unsigned char[channels * resize_rows * resize_cols];
-  std::fill(res, res + channels * resize_rows * resize_cols, 0);
+  auto res = AllocImageBuffer(static_cast<size_t>(kChannels) * resize_rows * resize_cols);
+  SourceReplicas replicas(src);
+  ResizeInto(replicas, tables, res);
+
+  return RGBImage{resize_cols, resize_rows, kChannels, res};
+}
+
+// Converts two rows of resized RGB to JFIF YCbCr: both luma rows at full
+// resolution and one chroma row from the mean of every 2x2 block, replicating
+// the last column (and, through `below` == `above`, the last row) at odd
+// sizes. Chroma is linear in RGB, so averaging the pixels first needs one
+// conversion per block instead of four.
+static void StoreRowPair420(const unsigned char *above,
+                            const unsigned char *below, int cols,
+                            unsigned char *y_above, unsigned char *y_below,
+                            unsigned char *cb, unsigned char *cr) {
+  auto luma = [](const unsigned char *p) {
+    return static_cast<unsigned char>(0.299f * p[0] + 0.587f * p[1] +
+                                      0.114f * p[2] + 0.5f);
+  };
+  auto saturate = [](float v) {
+    return static_cast<unsigned char>(std::min(std::max(v, 0.f), 255.f));
+  };
+  for (int j = 0; j < cols; j++) {
+    y_above[j] = luma(above + j * kChannels);
+    y_below[j] = luma(below + j * kChannels);
+  }
+  for (int j = 0; j < (cols + 1) / 2; j++) {
+    const int left = 2 * j * kChannels;
+    const int right = std::min(2 * j + 1, cols - 1) * kChannels;
+    float rgb[kChannels];
+    for (int c = 0; c < kChannels; c++) {
+      rgb[c] = 0.25f * (above[left + c] + above[right + c] + below[left + c] +
+                        below[right + c]);
+    }
+    cb[j] = saturate(128.5f - 0.168736f * rgb[0] - 0.331264f * rgb[1] +
+                     0.5f * rgb[2]);
+    cr[j] = saturate(128.5f + 0.5f * rgb[0] - 0.418688f * rgb[1] -
+                     0.081312f * rgb[2]);
+  }
+}
+
+// Resizes straight into 4:2:0 planes. Workers go two output rows at a time
+// through a scratch buffer that stays in cache, so the interleaved RGB result
+// never reaches memory and the encoder gets a quarter of the chroma samples.
+static void ResizeInto420(const SourceReplicas &replicas,
+                          const ResizeTables &tables, YCbCrImage *res) {
+  const int cols = res->cols;
+  const size_t stride = static_cast<size_t>(cols) * kChannels;
+  const int chroma_cols = res->chroma_cols();
+  ParallelStripes(res->chroma_rows(), [&](int node, int begin, int end) {
+    std::vector<unsigned char> scratch(2 * stride);
+    for (int pair = begin; pair < end; pair++) {
+      const int row = 2 * pair;
+      const int last = std::min(row + 2, res->rows) - 1;
+      ResizeRegion(replicas[node], tables.rows, tables.cols, row, last + 1, 0,
+                   cols, scratch.data(), stride);
+      unsigned char *y = res->plane(0) + static_cast<size_t>(row) * cols;
+      const size_t chroma = static_cast<size_t>(pair) * chroma_cols;
+      StoreRowPair420(scratch.data(), scratch.data() + (last - row) * stride,
+                      cols, y, y + (last - row) * cols,
+                      res->plane(1) + chroma, res->plane(2) + chroma);
+    }
+  });
+}
+
+// Like ResizeImage, but the result comes out as 4:2:0 YCbCr ready for
+// StoreImageYCbCr instead of interleaved RGB.
+YCbCrImage ResizeImage420(const RGBImage &src, float ratio) {
+  Timer timer("resize image by 5x to 4:2:0");
+  ResizeTables tables;
+  BuildResizeTables(src, ratio, &tables);
+  YCbCrImage res{tables.resize_cols, tables.resize_rows, 2, 2, nullptr};
 
-  const int n=8;
-  std::thread PartThread[n][n];
+  printf("resize to: %d x %d\n", res.rows, res.cols);
 
-  for(int x = 0 ; x < n ; x++)
-    for(int y = 0 ; y < n ; y++){
-      PartThread[x][y] = std::thread(ResizeImagePart, &src, ratio, (int)((resize_rows/n)*x), (int)((resize_rows/n)*(x+1)), (int)((resize_cols/n)*y), (int)((resize_cols/n)*(y+1)), res);
+  res.data = AllocImageBuffer(res.size());
+  if (!res.data) {
+    std::cerr << "out of memory for the resized planes" << std::endl;
+    return YCbCrImage{};
+  }
+  SourceReplicas replicas(src);
+  ResizeInto420(replicas, tables, &res);
+  return res;
+}
+
+// Computes only the part of the `ratio` times resized image that falls in
+// `roi` (output coordinates, clipped to the output). Weight tables are built
+// for the window alone and only the source rows and columns its taps touch are
+// read, so the cost follows the area of the window, not of the image.
+RGBImage ResizeImageRegion(const RGBImage &src, float ratio, ImageRect roi) {
+  const int resize_rows = src.rows * ratio;
+  const int resize_cols = src.cols * ratio;
+  int row_end = std::min(roi.row + roi.rows, resize_rows);
+  int col_end = std::min(roi.col + roi.cols, resize_cols);
+  roi.row = std::max(roi.row, 0);
+  roi.col = std::max(roi.col, 0);
+  roi.rows = std::max(row_end - roi.row, 0);
+  roi.cols = std::max(col_end - roi.col, 0);
+  if (roi.rows == 0 || roi.cols == 0)
+    return RGBImage{0, 0, kChannels, nullptr};
+
+  AxisWeights rows, cols;
+  BuildAxisWeights(src.rows, roi.rows, ratio, src.cols * kChannels, &rows,
+                   roi.row);
+  BuildAxisWeights(src.cols, roi.cols, ratio, kChannels, &cols, roi.col);
+  const size_t stride = static_cast<size_t>(roi.cols) * kChannels;
+  auto res = AllocImageBuffer(stride * roi.rows);
+  ParallelStripes(roi.rows, [&](int, int begin, int end) {
+    ResizeRegion(src.data, rows, cols, begin, end, 0, roi.cols,
+                 res + begin * stride, stride);
+  });
+  return RGBImage{roi.cols, roi.rows, kChannels, res};
+}
+
+// Output positions [*out_begin, *out_end) whose taps read any of the source
+// samples [begin, end) along `axis`; empty when none do. Taps only move
+// forward along the axis, so the affected positions are contiguous.
+static void AffectedRange(const AxisWeights &axis, int stride, int begin,
+                          int end, int *out_begin, int *out_end) {
+  *out_begin = axis.length;
+  *out_end = 0;
+  for (int i = 0; i < axis.length; i++) {
+    for (int k = 0; k < axis.taps; k++) {
+      int index = axis.offset[static_cast<size_t>(axis.taps) * i + k] / stride;
+      if (index >= begin && index < end) {
+        *out_begin = std::min(*out_begin, i);
+        *out_end = i + 1;
+        break;
+      }
     }
-  for(int x = 0 ; x < n ; x++)
-    for(int y = 0 ; y < n ; y++){
-      PartThread[x][y].join();
+  }
+  *out_end = std::max(*out_end, *out_begin);
+}
+
+// Brings `dst`, resized with `tables` from an earlier version of `src`, up to
+// date after the source pixels inside `dirty` changed. Each rectangle grows by
+// the kernel support into the output pixels that sample it, overlapping ones
+// are merged, and only those are recomputed, in parallel stripes over all of
+// their rows. Returns the output rectangles that were rewritten.
+static std::vector<ImageRect> ResizeDirtyInto(const RGBImage &src,
+                                              const ResizeTables &tables,
+                                              const std::vector<ImageRect> &dirty,
+                                              RGBImage *dst) {
+  std::vector<ImageRect> out;
+  if (dst->rows != tables.resize_rows || dst->cols != tables.resize_cols)
+    return out;
+  for (const auto &rect : dirty) {
+    ImageRect r;
+    int row_end, col_end;
+    AffectedRange(tables.rows, src.cols * kChannels, rect.row,
+                  rect.row + rect.rows, &r.row, &row_end);
+    AffectedRange(tables.cols, kChannels, rect.col, rect.col + rect.cols,
+                  &r.col, &col_end);
+    r.rows = row_end - r.row;
+    r.cols = col_end - r.col;
+    if (r.rows > 0 && r.cols > 0)
+      out.push_back(r);
+  }
+
+  // merge overlapping rectangles into their bounding box until none overlap,
+  // so no output pixel is computed twice
+  auto overlaps = [](const ImageRect &a, const ImageRect &b) {
+    return a.row < b.row + b.rows && b.row < a.row + a.rows &&
+           a.col < b.col + b.cols && b.col < a.col + a.cols;
+  };
+  for (bool merged = true; merged;) {
+    merged = false;
+    for (size_t i = 0; i < out.size() && !merged; i++) {
+      for (size_t j = i + 1; j < out.size() && !merged; j++) {
+        if (!overlaps(out[i], out[j]))
+          continue;
+        ImageRect &a = out[i];
+        const ImageRect &b = out[j];
+        int row_end = std::max(a.row + a.rows, b.row + b.rows);
+        int col_end = std::max(a.col + a.cols, b.col + b.cols);
+        a.row = std::min(a.row, b.row);
+        a.col = std::min(a.col, b.col);
+        a.rows = row_end - a.row;
+        a.cols = col_end - a.col;
+        out.erase(out.begin() + j);
+        merged = true;
+      }
+    }
+  }
+
+  // the rows of all rectangles back to back, split across the workers
+  std::vector<int> first_row(out.size() + 1, 0);
+  for (size_t k = 0; k < out.size(); k++)
+    first_row[k + 1] = first_row[k] + out[k].rows;
+  if (first_row.back() == 0)
+    return out;
+  const size_t stride = static_cast<size_t>(dst->cols) * kChannels;
+  SourceReplicas replicas(src);
+  ParallelStripes(first_row.back(), [&](int node, int begin, int end) {
+    size_t k = std::upper_bound(first_row.begin(), first_row.end(), begin) -
+               first_row.begin() - 1;
+    for (; begin < end; k++) {
+      const ImageRect &r = out[k];
+      int row_begin = r.row + begin - first_row[k];
+      int row_end = r.row + std::min(end, first_row[k + 1]) - first_row[k];
+      ResizeRegion(replicas[node], tables.rows, tables.cols, row_begin,
+                   row_end, r.col, r.col + r.cols,
+                   dst->data + row_begin * stride + r.col * kChannels, stride);
+      begin = first_row[k + 1];
     }
+  });
+  return out;
+}
 
-  return RGBImage{resize_cols, resize_rows, channels, res};
+// Incremental ResizeImage: `dst` holds ResizeImage(src, ratio) of the source
+// as it was before the pixels in the `dirty` rectangles (source coordinates)
+// were edited, and is updated in place to match the edited `src`.
+std::vector<ImageRect> ResizeImageDirty(const RGBImage &src, float ratio,
+                                        const std::vector<ImageRect> &dirty,
+                                        RGBImage *dst) {
+  Timer timer("resize dirty regions");
+  ResizeTables tables;
+  BuildResizeTables(src, ratio, &tables);
+  return ResizeDirtyInto(src, tables, dirty, dst);
 }
 
+// Geometry applied to the source before resizing: crop first, then the flips,
+// then a clockwise rotation by a multiple of 90 degrees.
+struct SourceTransform {
+  ImageRect crop{0, 0, 0, 0}; // empty: the whole source
+  bool flip_horizontal{false};
+  bool flip_vertical{false};
+  int rotate{0}; // 0, 90, 180 or 270
+};
+
+// The transform that displays an image carrying EXIF orientation tag 1-8.
+SourceTransform TransformForExifOrientation(int orientation) {
+  SourceTransform transform;
+  switch (orientation) {
+  case 2: transform.flip_horizontal = true; break;
+  case 3: transform.rotate = 180; break;
+  case 4: transform.flip_vertical = true; break;
+  case 5: transform.flip_horizontal = true; transform.rotate = 270; break;
+  case 6: transform.rotate = 90; break;
+  case 7: transform.flip_horizontal = true; transform.rotate = 90; break;
+  case 8: transform.rotate = 270; break;
+  }
+  return transform;
+}
+
+// Crops, flips, rotates and resizes in a single pass. None of the geometry
+// touches pixels: every output axis is sampled along one source axis, forwards
+// or backwards, inside the crop window, so it all folds into where the weight
+// tables point. A 90 or 270 degree rotation makes the output row table walk
+// source columns and the column table walk source rows.
+static void BuildTransformTables(const RGBImage &src, float ratio,
+                                 const SourceTransform &transform,
+                                 ResizeTables *tables) {
+  ImageRect crop = transform.crop;
+  if (crop.rows <= 0 || crop.cols <= 0)
+    crop = ImageRect{0, 0, src.rows, src.cols};
+  crop.row = std::min(std::max(crop.row, 0), src.rows - 1);
+  crop.col = std::min(std::max(crop.col, 0), src.cols - 1);
+  crop.rows = std::min(crop.rows, src.rows - crop.row);
+  crop.cols = std::min(crop.cols, src.cols - crop.col);
+
+  const int rotate = ((transform.rotate % 360) + 360) % 360;
+  const bool transpose = rotate == 90 || rotate == 270;
+  // the flips act on the cropped image, the rotation then reverses the axis
+  // that ends up on the right (90) or the bottom (270), or both (180)
+  bool reverse_rows = transform.flip_vertical;
+  bool reverse_cols = transform.flip_horizontal;
+  if (rotate == 90 || rotate == 180)
+    reverse_rows = !reverse_rows;
+  if (rotate == 270 || rotate == 180)
+    reverse_cols = !reverse_cols;
+
+  const int row_stride = src.cols * kChannels;
+  int &resize_rows = tables->resize_rows;
+  int &resize_cols = tables->resize_cols;
+  if (!transpose) {
+    resize_rows = crop.rows * ratio;
+    resize_cols = crop.cols * ratio;
+    BuildAxisWeights(crop.rows, resize_rows, ratio, row_stride, &tables->rows,
+                     0, crop.row, reverse_rows);
+    BuildAxisWeights(crop.cols, resize_cols, ratio, kChannels, &tables->cols,
+                     0, crop.col, reverse_cols);
+  } else {
+    resize_rows = crop.cols * ratio;
+    resize_cols = crop.rows * ratio;
+    BuildAxisWeights(crop.cols, resize_rows, ratio, kChannels, &tables->rows,
+                     0, crop.col, reverse_cols);
+    BuildAxisWeights(crop.rows, resize_cols, ratio, row_stride, &tables->cols,
+                     0, crop.row, reverse_rows);
+  }
+}
+
+RGBImage ResizeImageTransformed(const RGBImage &src, float ratio,
+                                const SourceTransform &transform) {
+  ResizeTables tables;
+  BuildTransformTables(src, ratio, transform, &tables);
+  auto res = AllocImageBuffer(static_cast<size_t>(kChannels) *
+                              tables.resize_rows * tables.resize_cols);
+  SourceReplicas replicas(src);
+  ResizeInto(replicas, tables, res);
+  return RGBImage{tables.resize_cols, tables.resize_rows, kChannels, res};
+}
+
+YCbCrImage ResizeImageTransformed420(const RGBImage &src, float ratio,
+                                     const SourceTransform &transform) {
+  ResizeTables tables;
+  BuildTransformTables(src, ratio, transform, &tables);
+  YCbCrImage res{tables.resize_cols, tables.resize_rows, 2, 2, nullptr};
+  res.data = AllocImageBuffer(res.size());
+  if (!res.data) {
+    std::cerr << "out of memory for the resized planes" << std::endl;
+    return YCbCrImage{};
+  }
+  SourceReplicas replicas(src);
+  ResizeInto420(replicas, tables, &res);
+  return res;
+}
+
+// Resizes one plane of samples, `src_stride` bytes per row, into a tightly
+// packed dst_rows x dst_cols plane. The ratios map output to source positions
+// along each axis like `ratio` does for whole images, offset by the shifts
+// (in source samples) when the planes are sited differently.
+static void ResizePlaneInto(const unsigned char *src, int src_rows,
+                            int src_cols, size_t src_stride, float row_ratio,
+                            float col_ratio, unsigned char *dst, int dst_rows,
+                            int dst_cols, float row_shift = 0,
+                            float col_shift = 0) {
+  AxisWeights rows, cols;
+  BuildAxisWeights(src_rows, dst_rows, row_ratio, src_stride, &rows, 0, 0,
+                   false, row_shift);
+  BuildAxisWeights(src_cols, dst_cols, col_ratio, 1, &cols, 0, 0, false,
+                   col_shift);
+  ParallelStripes(dst_rows, [&](int, int begin, int end) {
+    ResizeRegion<1>(src, rows, cols, begin, end, 0, dst_cols,
+                    dst + static_cast<size_t>(begin) * dst_cols, dst_cols);
+  });
+}
+
+// Resizes planar YCbCr by `ratio` without a round trip through RGB. Luma gets
+// the same size as ResizeImage would produce. Chroma is resized on its own
+// grid: any subsampled source gives a 4:2:0 result, a 4:4:4 source stays
+// 4:4:4, so for the common 4:2:0 JPEG each chroma plane costs a quarter of the
+// luma work. `subsample` makes a 4:4:4 source come out 4:2:0 as well, its
+// chroma resampled straight onto the half resolution grid. Chroma keeps the
+// JPEG siting (ChromaShift), so it stays aligned with luma. An empty image
+// when the output cannot be allocated.
+YCbCrImage ResizeImageYCbCr(const YCbCrImage &src, float ratio,
+                            bool subsample = false) {
+  Timer timer("resize YCbCr planes by 5x");
+  YCbCrImage res;
+  res.rows = src.rows * ratio;
+  res.cols = src.cols * ratio;
+  const bool subsampled = src.chroma_step_cols > 1 || src.chroma_step_rows > 1;
+  res.chroma_step_cols = res.chroma_step_rows =
+      subsampled || subsample ? 2 : 1;
+  printf("resize to: %d x %d\n", res.rows, res.cols);
+
+  res.data = AllocImageBuffer(res.size());
+  if (!res.data) {
+    std::cerr << "out of memory for the resized planes" << std::endl;
+    return YCbCrImage{};
+  }
+  ResizePlaneInto(src.plane(0), src.rows, src.cols, src.cols, ratio, ratio,
+                  res.plane(0), res.rows, res.cols);
+  const float row_ratio =
+      ratio * src.chroma_step_rows / res.chroma_step_rows;
+  const float col_ratio =
+      ratio * src.chroma_step_cols / res.chroma_step_cols;
+  const float row_shift =
+      ChromaShift(ratio, src.chroma_step_rows, res.chroma_step_rows);
+  const float col_shift =
+      ChromaShift(ratio, src.chroma_step_cols, res.chroma_step_cols);
+  for (int k = 1; k < 3; k++) {
+    ResizePlaneInto(src.plane(k), src.chroma_rows(), src.chroma_cols(),
+                    src.chroma_cols(), row_ratio, col_ratio, res.plane(k),
+                    res.chroma_rows(), res.chroma_cols(), row_shift,
+                    col_shift);
+  }
+  return res;
+}
+
+struct TargetSize {
+  int rows, cols;
+};
+
+// Produces every size in `sizes` from one pass over the source. Workers own
+// stripes of source rows and, a few source rows at a time, emit the output
+// rows of every target that sample them, so each source row is pulled into
+// cache once for all renditions instead of once per rendition. Targets that
+// share a width (or height) share the column (or row) weight table. Outputs
+// are allocated with AllocImageBuffer.
+std::vector<RGBImage> ResizeImageMulti(const RGBImage &src,
+                                       const std::vector<TargetSize> &sizes) {
+  Timer timer("resize image to " + std::to_string(sizes.size()) + " sizes");
+  std::map<int, AxisWeights> row_tables, col_tables;
+  std::vector<RGBImage> outputs;
+  for (const auto &size : sizes) {
+    if (!row_tables.count(size.rows)) {
+      BuildAxisWeights(src.rows, size.rows, float(size.rows) / src.rows,
+                       src.cols * kChannels, &row_tables[size.rows]);
+    }
+    if (!col_tables.count(size.cols)) {
+      BuildAxisWeights(src.cols, size.cols, float(size.cols) / src.cols,
+                       kChannels, &col_tables[size.cols]);
+    }
+    auto res = AllocImageBuffer(static_cast<size_t>(kChannels) * size.rows *
+                                size.cols);
+    outputs.push_back(RGBImage{size.cols, size.rows, kChannels, res});
+  }
+
+  // first output row of `dst_rows` whose sample position lies at or past
+  // source row `src_row`; exact integer math so neighbouring stripes never
+  // overlap or leave a gap
+  auto first_row = [&](int src_row, int dst_rows) {
+    return static_cast<int>(
+        (static_cast<long>(src_row) * dst_rows + src.rows - 1) / src.rows);
+  };
+
+  const int kSourceBlock = 16;
+  SourceReplicas replicas(src);
+  ParallelStripes(src.rows, [&](int node, int begin, int end) {
+    for (int block = begin; block < end; block += kSourceBlock) {
+      int block_end = std::min(block + kSourceBlock, end);
+      for (auto &out : outputs) {
+        int row_begin = first_row(block, out.rows);
+        int row_end = first_row(block_end, out.rows);
+        size_t stride = static_cast<size_t>(out.cols) * kChannels;
+        ResizeRegion(replicas[node], row_tables.at(out.rows),
+                     col_tables.at(out.cols), row_begin, row_end, 0, out.cols,
+                     out.data + row_begin * stride, stride);
+      }
+    }
+  });
+  return outputs;
+}
+
+// Keeps everything a batch of resizes needs between calls: weight tables for
+// the (source size, ratio) combinations seen so far, a pool of released pixel
+// buffers in power of two size classes and the per node source copies. Once
+// the batch has warmed up a resize of a size seen before allocates nothing
+// (on multi socket hosts the source is still copied to every node, into the
+// same buffers) and runs on the persistent worker pool. Not thread safe; give
+// each submitting thread its own context.
+class ResizeContext {
+public:
+  ResizeContext() = default;
+  ResizeContext(const ResizeContext &) = delete;
+  ResizeContext &operator=(const ResizeContext &) = delete;
+
+  ~ResizeContext() {
+    for (auto &pool : free_)
+      for (auto buffer : pool)
+        FreeImageBuffer(buffer);
+  }
+
+  // Shared so the tables outlive the cache being cleared by a later call.
+  std::shared_ptr<const ResizeTables> Tables(const RGBImage &src,
+                                             float ratio) {
+    auto key = std::make_tuple(src.rows, src.cols, ratio);
+    auto it = tables_.find(key);
+    if (it == tables_.end()) {
+      if (tables_.size() >= kMaxTables)
+        tables_.clear();
+      auto built = std::make_shared<ResizeTables>();
+      BuildResizeTables(src, ratio, built.get());
+      it = tables_.emplace(key, built).first;
+    }
+    return it->second;
+  }
+
+  // The buffer holds at least `size` bytes; its contents are unspecified.
+  unsigned char *Acquire(size_t size) {
+    auto &pool = free_[SizeClass(size)];
+    if (pool.empty())
+      return AllocImageBuffer(size_t(1) << SizeClass(size));
+    auto buffer = pool.back();
+    pool.pop_back();
+    return buffer;
+  }
+
+  void Release(unsigned char *buffer, size_t size) {
+    if (buffer)
+      free_[SizeClass(size)].push_back(buffer);
+  }
+
+  void Release(const RGBImage &img) {
+    Release(img.data, static_cast<size_t>(img.cols) * img.rows * img.channels);
+  }
+
+  // Like ResizeImage, but the result comes from the pool and has to go back
+  // through Release instead of FreeImageBuffer.
+  RGBImage Resize(const RGBImage &src, float ratio) {
+    auto tables = Tables(src, ratio);
+    auto res = Acquire(static_cast<size_t>(kChannels) * tables->resize_rows *
+                       tables->resize_cols);
+    if (!res)
+      return RGBImage{0, 0, kChannels, nullptr};
+    replicas_.Assign(src);
+    ResizeInto(replicas_, *tables, res);
+    return RGBImage{tables->resize_cols, tables->resize_rows, kChannels, res};
+  }
+
+  // ResizeImageDirty with the context's weight tables, for sources that are
+  // edited and re-resized over and over.
+  std::vector<ImageRect> ResizeDirty(const RGBImage &src, float ratio,
+                                     const std::vector<ImageRect> &dirty,
+                                     RGBImage *dst) {
+    return ResizeDirtyInto(src, *Tables(src, ratio), dirty, dst);
+  }
+
+private:
+  static const size_t kMaxTables = 64;
+  static const int kSizeClasses = 48;
+
+  static int SizeClass(size_t size) {
+    int cls = 6;
+    while ((size_t(1) << cls) < size)
+      cls++;
+    return cls;
+  }
+
+  std::map<std::tuple<int, int, float>, std::shared_ptr<const ResizeTables>>
+      tables_;
+  std::vector<unsigned char *> free_[kSizeClasses];
+  SourceReplicas replicas_;
+};
+
 #endif
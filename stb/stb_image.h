@@ -271,6 +271,11 @@ RECENT REVISION HISTORY:
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
 //
+// With GCC or Clang on x86, the JPEG color conversion and 2x2 chroma
+// upsampling additionally have AVX2 and AVX-512BW versions, compiled with
+// target attributes and picked at run time by CPU feature tests. Define
+// STBI_NO_AVX2 to leave them out.
+//
 // ===========================================================================
 //
 // HDR image support   (disable by defining STBI_NO_HDR)
@@ -430,6 +435,38 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+// Lets the decoders split work over the caller's threads. `func` must run
+// task(arg, begin, end) over disjoint ranges covering [0, count) and return
+// once all of them are done. Currently used by the JPEG decoder for restart
+// intervals of in-memory baseline images and for upsampling/color conversion.
+typedef void stbi_parallel_task(void *arg, int begin, int end);
+typedef void stbi_parallel_for_func(void *user, stbi_parallel_task *task, void *arg, int count);
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *func, void *user);
+
+#ifndef STBI_NO_JPEG
+// Like stbi_load_from_memory, but JPEGs are decoded at 1/scale_denom of their
+// size (scale_denom 1, 2, 4 or 8) by running a reduced IDCT on the low
+// frequency coefficients of each block; other formats load at full size.
+// *x and *y report the decoded size.
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int scale_denom);
+
+// Decodes a YCbCr JPEG to its component planes, skipping upsampling and color
+// conversion. Plane k holds w[k] x h[k] samples, stride[k] bytes apart; the
+// chroma planes keep the file's subsampling, hs[k] x vs[k] luma samples per
+// chroma sample. Free each raw[k] with stbi_image_free. Returns 0 for
+// anything that is not 3 component YCbCr (grey, RGB, CMYK) and for sampling
+// factors that do not divide evenly. scale_denom works as for
+// stbi_load_from_memory_scaled.
+typedef struct
+{
+   stbi_uc *data[3];
+   int w[3], h[3], stride[3];
+   int hs[3], vs[3];
+   void *raw[3];
+} stbi_ycbcr_planes;
+STBIDEF int stbi_load_jpeg_ycbcr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_ycbcr_planes *planes, int scale_denom);
+#endif
+
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
@@ -722,6 +759,11 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 #define STBI_SSE2
 #include <emmintrin.h>
 
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(STBI_NO_AVX2) && !defined(STBI_NO_JPEG)
+#define STBI__AVX_DISPATCH
+#include <immintrin.h>
+#endif
+
 #ifdef _MSC_VER
 
 #if _MSC_VER >= 1400  // not VC6
@@ -747,7 +789,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -758,7 +800,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -1093,6 +1135,63 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 
 static int stbi__vertically_flip_on_load_global = 0;
 
+static stbi_parallel_for_func *stbi__parallel_for = NULL;
+static void *stbi__parallel_user = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *func, void *user)
+{
+   stbi__parallel_for = func;
+   stbi__parallel_user = user;
+}
+
+// runs the whole range on the calling thread when no parallel_for is set
+static void stbi__run_parallel(stbi_parallel_task *task, void *arg, int count)
+{
+   if (stbi__parallel_for && count > 1)
+      stbi__parallel_for(stbi__parallel_user, task, arg, count);
+   else if (count > 0)
+      task(arg, 0, count);
+}
+
+// Progress counters for work handed between two tasks of one parallel_for
+// (the PNG decoder pipelines inflate and unfiltering). Without GCC-style
+// atomics nothing is pipelined and these are plain loads and stores.
+#if defined(__GNUC__) || defined(__clang__)
+#define STBI__PIPELINE
+#if defined(__unix__) || defined(__APPLE__)
+#include <sched.h>
+#define STBI__YIELD() sched_yield()
+#endif
+#endif
+#ifndef STBI__YIELD
+#define STBI__YIELD()
+#endif
+
+static void stbi__publish_progress(unsigned int *counter, unsigned int value)
+{
+#ifdef STBI__PIPELINE
+   __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+#else
+   *counter = value;
+#endif
+}
+
+static unsigned int stbi__read_progress(unsigned int *counter)
+{
+#ifdef STBI__PIPELINE
+   return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+#else
+   return *counter;
+#endif
+}
+
+// marks a parallel job as failed; any number of its tasks may do so at once,
+// the caller checks the flag after stbi__run_parallel returns
+static void stbi__fail_job(unsigned int *failed)
+{
+   stbi__publish_progress(failed, 1);
+}
+
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
    stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
@@ -1973,6 +2072,7 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // blocks decode to (8>>scale_shift)^2 pixels
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2912,8 +3012,144 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// decodes `count` MCUs of a baseline scan starting at MCU `first`, ignoring
+// restart markers; the caller positions the bitstream at the matching interval.
+// Returns 0 on a corrupt block.
+static int stbi__decode_mcu_range(stbi__jpeg *z, int first, int count)
+{
+   STBI_SIMD_ALIGN(short, data[64]);
+   int m;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      int w = (z->img_comp[n].x+7) >> 3;
+      int ha = z->img_comp[n].ha;
+      for (m = first; m < first + count; ++m) {
+         int i = m % w, j = m / w;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j+i)*8 >> z->scale_shift), z->img_comp[n].w2, data);
+      }
+   } else {
+      int k,x,y;
+      for (m = first; m < first + count; ++m) {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            int ha = z->img_comp[n].ha;
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8 >> z->scale_shift;
+                  int y2 = (j*z->img_comp[n].v + y)*8 >> z->scale_shift;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **starts; // first entropy byte of every restart interval
+   stbi_uc *end;     // the marker that ends the scan
+   int segments, total_mcus;
+   unsigned int failed, out_of_memory; // set through stbi__fail_job
+} stbi__jpeg_restart_job;
+
+static void stbi__decode_restart_segments(void *arg, int begin, int end)
+{
+   stbi__jpeg_restart_job *job = (stbi__jpeg_restart_job *) arg;
+   // a private decoder and input context per task, reused for its segments
+   stbi__jpeg *local = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__context ctx = *job->z->s;
+   int seg;
+   if (!local) {
+      stbi__fail_job(&job->out_of_memory);
+      return;
+   }
+   *local = *job->z;
+   local->s = &ctx;
+   for (seg = begin; seg < end; ++seg) {
+      int first = seg * job->z->restart_interval;
+      int count = job->total_mcus - first < job->z->restart_interval ? job->total_mcus - first : job->z->restart_interval;
+      ctx.img_buffer = job->starts[seg];
+      ctx.img_buffer_end = seg + 1 < job->segments ? job->starts[seg+1] : job->end;
+      stbi__jpeg_reset(local);
+      if (!stbi__decode_mcu_range(local, first, count)) {
+         stbi__fail_job(&job->failed);
+         break;
+      }
+   }
+   STBI_FREE(local);
+}
+
+// Baseline scans with restart markers decode as independent intervals. For
+// in-memory sources we find every RSTn up front and hand the intervals to the
+// parallel_for. Returns -1 when this does not apply, leaving the input alone.
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   stbi__jpeg_restart_job job;
+   stbi_uc *p;
+   int capacity;
+   if (!stbi__parallel_for || z->progressive || z->restart_interval <= 0 || s->read_from_callbacks)
+      return -1;
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      job.total_mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else {
+      job.total_mcus = z->img_mcu_x * z->img_mcu_y;
+   }
+   job.segments = (job.total_mcus + z->restart_interval - 1) / z->restart_interval;
+   if (job.segments < 2)
+      return -1;
+
+   capacity = job.segments;
+   job.starts = (stbi_uc **) stbi__malloc_mad2(capacity, sizeof(stbi_uc *), 0);
+   if (!job.starts)
+      return -1;
+   job.z = z;
+   job.end = NULL;
+   job.failed = job.out_of_memory = 0;
+   job.starts[0] = s->img_buffer;
+   {
+      int found = 1;
+      for (p = s->img_buffer; p + 1 < s->img_buffer_end; ++p) {
+         if (p[0] != 0xff || p[1] == 0x00 || p[1] == 0xff)
+            continue;
+         if (STBI__RESTART(p[1])) {
+            if (found == capacity) { found = -1; break; }
+            job.starts[found++] = p + 2;
+            ++p;
+         } else {
+            job.end = p;
+            break;
+         }
+      }
+      if (found != job.segments || !job.end) {
+         // truncated or corrupt scan; let the serial decoder deal with it
+         STBI_FREE(job.starts);
+         return -1;
+      }
+   }
+   stbi__run_parallel(stbi__decode_restart_segments, &job, job.segments);
+   STBI_FREE(job.starts);
+   // the tasks' own stbi__err calls went to their threads, report it here
+   if (job.out_of_memory) return stbi__err("outofmem", "Out of memory");
+   if (job.failed) return stbi__err("bad huffman code", "Corrupt JPEG");
+   // continue after the scan exactly like the serial decoder would
+   s->img_buffer = job.end;
+   z->marker = STBI__MARKER_none;
+   return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+   int parallel = stbi__parse_entropy_coded_data_parallel(z);
+   if (parallel >= 0)
+      return parallel;
    stbi__jpeg_reset(z);
    if (!z->progressive) {
       if (z->scan_n == 1) {
@@ -2930,7 +3166,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j+i)*8 >> z->scale_shift), z->img_comp[n].w2, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2954,8 +3190,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*8 >> z->scale_shift;
+                        int y2 = (j*z->img_comp[n].v + y)*8 >> z->scale_shift;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
                         z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
@@ -3055,7 +3291,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j+i)*8 >> z->scale_shift), z->img_comp[n].w2, data);
             }
          }
       }
@@ -3294,8 +3530,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8 >> z->scale_shift;
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8 >> z->scale_shift;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3305,10 +3541,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // one 8x8 coefficient block per block, whatever size it decodes to
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3763,9 +3999,250 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI__AVX_DISPATCH
+// Wider versions of the SSE2 kernels above. All the arithmetic is the same
+// 16-bit fixed point, so the output matches stbi__YCbCr_to_RGB_row and
+// stbi__resample_row_hv_2 exactly, and unlike the SSE2 version they also
+// cover step == 3, which is what RGB (rather than RGBA) loads use.
+
+// writes 16 pixels of r, g, b (and opaque alpha for step == 4)
+__attribute__((target("avx2")))
+static inline void stbi__store_rgb16_avx2(stbi_uc *out, __m128i r, __m128i g, __m128i b, int step)
+{
+   if (step == 4) {
+      __m128i x  = _mm_set1_epi8((char) 255);
+      __m128i rg0 = _mm_unpacklo_epi8(r, g), rg1 = _mm_unpackhi_epi8(r, g);
+      __m128i bx0 = _mm_unpacklo_epi8(b, x), bx1 = _mm_unpackhi_epi8(b, x);
+      _mm_storeu_si128((__m128i *) (out +  0), _mm_unpacklo_epi16(rg0, bx0));
+      _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi16(rg0, bx0));
+      _mm_storeu_si128((__m128i *) (out + 32), _mm_unpacklo_epi16(rg1, bx1));
+      _mm_storeu_si128((__m128i *) (out + 48), _mm_unpackhi_epi16(rg1, bx1));
+   } else {
+      // each 16 byte output chunk gathers its bytes from all three channels
+      __m128i o0 = _mm_or_si128(_mm_or_si128(
+         _mm_shuffle_epi8(r, _mm_setr_epi8(0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1,-1,5)),
+         _mm_shuffle_epi8(g, _mm_setr_epi8(-1,0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1,-1))),
+         _mm_shuffle_epi8(b, _mm_setr_epi8(-1,-1,0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1)));
+      __m128i o1 = _mm_or_si128(_mm_or_si128(
+         _mm_shuffle_epi8(r, _mm_setr_epi8(-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1,10,-1)),
+         _mm_shuffle_epi8(g, _mm_setr_epi8(5,-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1,10))),
+         _mm_shuffle_epi8(b, _mm_setr_epi8(-1,5,-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1)));
+      __m128i o2 = _mm_or_si128(_mm_or_si128(
+         _mm_shuffle_epi8(r, _mm_setr_epi8(-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1,-1)),
+         _mm_shuffle_epi8(g, _mm_setr_epi8(-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1))),
+         _mm_shuffle_epi8(b, _mm_setr_epi8(10,-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15)));
+      _mm_storeu_si128((__m128i *) (out +  0), o0);
+      _mm_storeu_si128((__m128i *) (out + 16), o1);
+      _mm_storeu_si128((__m128i *) (out + 32), o2);
+   }
+}
+
+__attribute__((target("avx2")))
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+   if (step == 3 || step == 4) {
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i y_round   = _mm256_set1_epi16(8);
+
+      for (; i+15 < count; i += 16) {
+         // y*16 + 8 and (c-128) << 8, as the SSE2 unpacks produce them
+         __m256i yws = _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (y+i))), 4), y_round);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(_mm_xor_si128(_mm_loadu_si128((__m128i *) (pcr+i)), signflip)), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(_mm_xor_si128(_mm_loadu_si128((__m128i *) (pcb+i)), signflip)), 8);
+
+         __m256i rws = _mm256_add_epi16(_mm256_mulhi_epi16(cr_const0, crw), yws);
+         __m256i gws = _mm256_add_epi16(_mm256_add_epi16(_mm256_mulhi_epi16(cb_const0, cbw), yws), _mm256_mulhi_epi16(crw, cr_const1));
+         __m256i bws = _mm256_add_epi16(yws, _mm256_mulhi_epi16(cbw, cb_const1));
+         __m256i rw  = _mm256_srai_epi16(rws, 4);
+         __m256i gw  = _mm256_srai_epi16(gws, 4);
+         __m256i bw  = _mm256_srai_epi16(bws, 4);
+
+         stbi__store_rgb16_avx2(out,
+            _mm_packus_epi16(_mm256_castsi256_si128(rw), _mm256_extracti128_si256(rw, 1)),
+            _mm_packus_epi16(_mm256_castsi256_si128(gw), _mm256_extracti128_si256(gw, 1)),
+            _mm_packus_epi16(_mm256_castsi256_si128(bw), _mm256_extracti128_si256(bw, 1)), step);
+         out += 16*step;
+      }
+   }
+   // the scalar row code does the same math for the leftovers
+   stbi__YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void stbi__YCbCr_to_RGB_avx512(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+   if (step == 3 || step == 4) {
+      __m512i cr_const0 = _mm512_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m512i cr_const1 = _mm512_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m512i cb_const0 = _mm512_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m512i cb_const1 = _mm512_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i signflip  = _mm256_set1_epi8(-0x80);
+      __m512i y_round   = _mm512_set1_epi16(8);
+      __m512i zero      = _mm512_setzero_si512();
+
+      for (; i+31 < count; i += 32) {
+         __m512i yws = _mm512_add_epi16(_mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (y+i))), 4), y_round);
+         __m512i crw = _mm512_slli_epi16(_mm512_cvtepi8_epi16(_mm256_xor_si256(_mm256_loadu_si256((__m256i *) (pcr+i)), signflip)), 8);
+         __m512i cbw = _mm512_slli_epi16(_mm512_cvtepi8_epi16(_mm256_xor_si256(_mm256_loadu_si256((__m256i *) (pcb+i)), signflip)), 8);
+
+         __m512i rws = _mm512_add_epi16(_mm512_mulhi_epi16(cr_const0, crw), yws);
+         __m512i gws = _mm512_add_epi16(_mm512_add_epi16(_mm512_mulhi_epi16(cb_const0, cbw), yws), _mm512_mulhi_epi16(crw, cr_const1));
+         __m512i bws = _mm512_add_epi16(yws, _mm512_mulhi_epi16(cbw, cb_const1));
+         // clamp below at 0, the narrowing saturates above at 255
+         __m256i r = _mm512_cvtusepi16_epi8(_mm512_max_epi16(_mm512_srai_epi16(rws, 4), zero));
+         __m256i g = _mm512_cvtusepi16_epi8(_mm512_max_epi16(_mm512_srai_epi16(gws, 4), zero));
+         __m256i b = _mm512_cvtusepi16_epi8(_mm512_max_epi16(_mm512_srai_epi16(bws, 4), zero));
+
+         stbi__store_rgb16_avx2(out, _mm256_castsi256_si128(r), _mm256_castsi256_si128(g), _mm256_castsi256_si128(b), step);
+         stbi__store_rgb16_avx2(out + 16*step, _mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(b, 1), step);
+         out += 32*step;
+      }
+   }
+   stbi__YCbCr_to_RGB_avx2(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+// Output pixels 2i-1 and 2i only depend on columns i-1 and i of the vertically
+// filtered row, so instead of shifting registers both are loaded directly.
+__attribute__((target("avx2")))
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i,t0,t1;
+   __m256i bias = _mm256_set1_epi16(8);
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   out[0] = stbi__div4(t1+2);
+   for (i=1; i+16 <= w; i += 16) {
+      __m256i np = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i-1)));
+      __m256i fp = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far  + i-1)));
+      __m256i nc = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i fc = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far  + i)));
+      __m256i prev = _mm256_add_epi16(_mm256_add_epi16(np, np), _mm256_add_epi16(np, fp));
+      __m256i curr = _mm256_add_epi16(_mm256_add_epi16(nc, nc), _mm256_add_epi16(nc, fc));
+      // 3*prev + curr lands on pixel 2i-1, 3*curr + prev on pixel 2i
+      __m256i lo = _mm256_add_epi16(_mm256_add_epi16(prev, curr), bias);
+      __m256i odd  = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_add_epi16(prev, prev)), 4);
+      __m256i even = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_add_epi16(curr, curr)), 4);
+      // interleaving within each 128-bit lane then packing keeps pixel order
+      __m256i outv = _mm256_packus_epi16(_mm256_unpacklo_epi16(odd, even), _mm256_unpackhi_epi16(odd, even));
+      _mm256_storeu_si256((__m256i *) (out + i*2-1), outv);
+   }
+   t1 = 3*in_near[i-1] + in_far[i-1];
+   for (; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static stbi_uc *stbi__resample_row_hv_2_avx512(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i,t0,t1;
+   __m512i bias = _mm512_set1_epi16(8);
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   out[0] = stbi__div4(t1+2);
+   for (i=1; i+32 <= w; i += 32) {
+      __m512i np = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (in_near + i-1)));
+      __m512i fp = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (in_far  + i-1)));
+      __m512i nc = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (in_near + i)));
+      __m512i fc = _mm512_cvtepu8_epi16(_mm256_loadu_si256((__m256i *) (in_far  + i)));
+      __m512i prev = _mm512_add_epi16(_mm512_add_epi16(np, np), _mm512_add_epi16(np, fp));
+      __m512i curr = _mm512_add_epi16(_mm512_add_epi16(nc, nc), _mm512_add_epi16(nc, fc));
+      __m512i lo = _mm512_add_epi16(_mm512_add_epi16(prev, curr), bias);
+      __m512i odd  = _mm512_srli_epi16(_mm512_add_epi16(lo, _mm512_add_epi16(prev, prev)), 4);
+      __m512i even = _mm512_srli_epi16(_mm512_add_epi16(lo, _mm512_add_epi16(curr, curr)), 4);
+      __m512i outv = _mm512_packus_epi16(_mm512_unpacklo_epi16(odd, even), _mm512_unpackhi_epi16(odd, even));
+      _mm512_storeu_si512((void *) (out + i*2-1), outv);
+   }
+   t1 = 3*in_near[i-1] + in_far[i-1];
+   for (; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+#endif // STBI__AVX_DISPATCH
+
+// reduced IDCTs for scaled decoding: an NxN output block (N = 4, 2, 1) from
+// the top-left NxN coefficients. This is the full 8x8 IDCT evaluated at the
+// centre of every (8/N)x(8/N) group of pixels, so the result is the block
+// downsampled with the DCT's own low-pass instead of a separate filter.
+static void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], int n)
+{
+   // (u ? 1 : 1/sqrt(2)) * cos((2x+1) u pi / 2N) for N = 4, 2, 1, x and u < N
+   static const float cos_table[3][4][4] = {
+      { { 0.707106769f, 0.923879504f, 0.707106769f, 0.382683426f },
+        { 0.707106769f, 0.382683426f, -0.707106769f, -0.923879504f },
+        { 0.707106769f, -0.382683426f, -0.707106769f, 0.923879504f },
+        { 0.707106769f, -0.923879504f, 0.707106769f, -0.382683426f } },
+      { { 0.707106769f, 0.707106769f, 0, 0 },
+        { 0.707106769f, -0.707106769f, 0, 0 },
+        { 0, 0, 0, 0 },
+        { 0, 0, 0, 0 } },
+      { { 0.707106769f, 0, 0, 0 },
+        { 0, 0, 0, 0 },
+        { 0, 0, 0, 0 },
+        { 0, 0, 0, 0 } },
+   };
+   float tmp[4][4];
+   int u, v, x, y, t = n == 4 ? 0 : n == 2 ? 1 : 2;
+   // rows of coefficients (vertical frequency v) to columns of pixels
+   for (v=0; v < n; ++v)
+      for (x=0; x < n; ++x) {
+         float sum = 0;
+         for (u=0; u < n; ++u)
+            sum += cos_table[t][x][u] * data[v*8+u];
+         tmp[v][x] = sum;
+      }
+   for (y=0; y < n; ++y, out += out_stride)
+      for (x=0; x < n; ++x) {
+         float sum = 0;
+         for (v=0; v < n; ++v)
+            sum += cos_table[t][y][v] * tmp[v][x];
+         out[x] = stbi__clamp((int) floorf(sum * 0.25f + 128.5f));
+      }
+}
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64]) { stbi__idct_reduced(out, out_stride, data, 4); }
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64]) { stbi__idct_reduced(out, out_stride, data, 2); }
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   // DC only: (F00 / 8) + 128
+   out[0] = stbi__clamp((data[0] + 4 + 1024) >> 3);
+}
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->scale_shift = 0;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3778,6 +4255,16 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI__AVX_DISPATCH
+   if (__builtin_cpu_supports("avx512bw")) {
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx512;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx512;
+   } else if (__builtin_cpu_supports("avx2")) {
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
@@ -3808,6 +4295,179 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample res_comp[4]; // state for output row 0
+   stbi_uc *output;
+   int n, decode_n, is_rgb;
+   unsigned int failed; // out of memory in some task, set through stbi__fail_job
+} stbi__jpeg_convert_job;
+
+// upsamples and color converts output rows [begin, end); rows only depend on
+// the decoded planes, so any split of the image works
+static void stbi__jpeg_convert_rows(void *arg, int begin, int end)
+{
+   stbi__jpeg_convert_job *job = (stbi__jpeg_convert_job *) arg;
+   stbi__jpeg *z = job->z;
+   int n = job->n, decode_n = job->decode_n, is_rgb = job->is_rgb;
+   int k;
+   unsigned int i, j;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *linebuf[4] = { NULL, NULL, NULL, NULL };
+   stbi__resample res_comp[4];
+   // the row converters store one byte past the last pixel when n == 3, which
+   // would land in the next task's first row; the final row goes through here
+   stbi_uc *last_row = (stbi_uc *) stbi__malloc_mad2(n, z->s->img_x, 1);
+   if (!last_row) {
+      stbi__fail_job(&job->failed);
+      return;
+   }
+
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      // fast-forward the vertical resampler from row 0 to row `begin`
+      int steps = begin + (job->res_comp[k].vs >> 1);
+      int wraps = steps / job->res_comp[k].vs;
+      int last = z->img_comp[k].y - 1;
+      *r = job->res_comp[k];
+      r->ystep = steps % r->vs;
+      r->ypos  = wraps;
+      r->line1 = z->img_comp[k].data + (wraps < last ? wraps : last) * z->img_comp[k].w2;
+      r->line0 = z->img_comp[k].data + (wraps - 1 < 0 ? 0 : wraps - 1 < last ? wraps - 1 : last) * z->img_comp[k].w2;
+      // line buffer big enough for upsampling off the edges with upsample
+      // factor of 4
+      linebuf[k] = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!linebuf[k]) {
+         stbi__fail_job(&job->failed);
+         goto done;
+      }
+   }
+
+   for (j=begin; j < (unsigned int) end; ++j) {
+      stbi_uc *row = job->output + n * z->s->img_x * j;
+      stbi_uc *out = j + 1 == (unsigned int) end ? last_row : row;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      if (j + 1 == (unsigned int) end)
+         memcpy(row, last_row, n * z->s->img_x);
+   }
+done:
+   for (k=0; k < decode_n; ++k)
+      STBI_FREE(linebuf[k]);
+   STBI_FREE(last_row);
+}
+
+// after a reduced-size decode only the reduced planes matter
+static void stbi__jpeg_apply_scale(stbi__jpeg *z)
+{
+   int k, round = (1 << z->scale_shift) - 1;
+   if (!z->scale_shift) return;
+   z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+   z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+   for (k=0; k < z->s->img_n; ++k) {
+      z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale_shift;
+      z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale_shift;
+   }
+}
+
+static void stbi__jpeg_set_scale(stbi__jpeg *j, int scale_denom)
+{
+   int shift = scale_denom >= 8 ? 3 : scale_denom >= 4 ? 2 : scale_denom >= 2 ? 1 : 0;
+   j->scale_shift = shift;
+   if (shift)
+      j->idct_block_kernel = shift == 1 ? stbi__idct_block_4x4 : shift == 2 ? stbi__idct_block_2x2 : stbi__idct_block_1x1;
+}
+
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n, is_rgb;
@@ -3819,6 +4479,8 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   stbi__jpeg_apply_scale(z);
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -3836,20 +4498,13 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
       stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
       stbi__resample res_comp[4];
+      stbi__jpeg_convert_job job;
 
       for (k=0; k < decode_n; ++k) {
          stbi__resample *r = &res_comp[k];
 
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
          r->hs      = z->img_h_max / z->img_comp[k].h;
          r->vs      = z->img_v_max / z->img_comp[k].v;
          r->ystep   = r->vs >> 1;
@@ -3864,106 +4519,25 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
          else                               r->resample = stbi__resample_row_generic;
       }
 
-      // can't error after this so, this is safe
+      // only running out of memory in the conversion tasks can fail after this
       output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
-         }
-      }
+      job.z = z;
+      job.output = output;
+      job.n = n;
+      job.decode_n = decode_n;
+      job.is_rgb = is_rgb;
+      job.failed = 0;
+      for (k=0; k < decode_n; ++k)
+         job.res_comp[k] = res_comp[k];
+      stbi__run_parallel(stbi__jpeg_convert_rows, &job, z->s->img_y);
       stbi__cleanup_jpeg(z);
+      if (job.failed) {
+         STBI_FREE(output);
+         return stbi__errpuc("outofmem", "Out of memory");
+      }
       *out_x = z->s->img_x;
       *out_y = z->s->img_y;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
@@ -3984,6 +4558,67 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    return result;
 }
 
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale_denom)
+{
+   stbi__context s;
+   stbi__jpeg* j;
+   stbi_uc *result;
+   stbi__start_mem(&s,buffer,len);
+   if (scale_denom < 2 || !stbi__jpeg_test(&s))
+      return stbi_load_from_memory(buffer, len, x, y, comp, req_comp);
+   j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return stbi__errpuc("outofmem", "Out of memory");
+   j->s = &s;
+   stbi__setup_jpeg(j);
+   stbi__jpeg_set_scale(j, scale_denom);
+   result = load_jpeg_image(j, x, y, comp, req_comp);
+   STBI_FREE(j);
+   return result;
+}
+
+STBIDEF int stbi_load_jpeg_ycbcr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, stbi_ycbcr_planes *planes, int scale_denom)
+{
+   stbi__context s;
+   stbi__jpeg* j;
+   int k, ok = 0;
+   memset(planes, 0, sizeof(*planes));
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__jpeg_test(&s))
+      return stbi__err("not JPEG", "Corrupt JPEG");
+   j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return stbi__err("outofmem", "Out of memory");
+   j->s = &s;
+   stbi__setup_jpeg(j);
+   stbi__jpeg_set_scale(j, scale_denom);
+   j->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   if (stbi__decode_jpeg_image(j)) {
+      int is_rgb = j->rgb == 3 || (j->app14_color_transform == 0 && !j->jfif);
+      ok = j->s->img_n == 3 && !is_rgb;
+      for (k=0; ok && k < 3; ++k)
+         ok = j->img_h_max % j->img_comp[k].h == 0 && j->img_v_max % j->img_comp[k].v == 0;
+      if (ok) {
+         stbi__jpeg_apply_scale(j);
+         for (k=0; k < 3; ++k) {
+            planes->data[k]   = j->img_comp[k].data;
+            planes->w[k]      = j->img_comp[k].x;
+            planes->h[k]      = j->img_comp[k].y;
+            planes->stride[k] = j->img_comp[k].w2;
+            planes->hs[k]     = j->img_h_max / j->img_comp[k].h;
+            planes->vs[k]     = j->img_v_max / j->img_comp[k].v;
+            planes->raw[k]    = j->img_comp[k].raw_data;
+            j->img_comp[k].raw_data = NULL; // now owned by the caller
+         }
+         *x = j->s->img_x;
+         *y = j->s->img_y;
+      } else {
+         stbi__err("not YCbCr", "JPEG is not 3 component YCbCr");
+      }
+   }
+   stbi__cleanup_jpeg(j);
+   STBI_FREE(j);
+   return ok;
+}
+
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
@@ -4128,6 +4763,13 @@ typedef struct
    char *zout_end;
    int   z_expandable;
 
+   // with zout_step set, zout_end is only the next progress checkpoint: the
+   // output fits in zout_start..zout_limit, and every time it crosses a
+   // checkpoint the bytes written so far are published to *zout_progress
+   char *zout_limit;
+   unsigned int zout_step;
+   unsigned int *zout_progress;
+
    stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
 
@@ -4206,6 +4848,16 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
+   if (z->zout_step) {
+      unsigned int end, cap = (unsigned int) (z->zout_limit - z->zout_start);
+      cur = (unsigned int) (zout - z->zout_start);
+      stbi__publish_progress(z->zout_progress, cur);
+      if ((unsigned) n <= cap - cur) {
+         end = cur + (n > (int) z->zout_step ? (unsigned) n : z->zout_step);
+         z->zout_end = z->zout_start + (end < cap ? end : cap);
+         return 1;
+      }
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
@@ -4435,6 +5087,7 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zout_step  = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4590,8 +5243,146 @@ static int stbi__paeth(int a, int b, int c)
 
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
+#ifdef STBI_SSE2
+// Pixels move through the low dword of a register. Inside a row 3 byte pixels
+// are read and written as 4 bytes: the extra lane is never looked at, and the
+// byte stored past the pixel is the next one's, which is rewritten right
+// after. Only the last pixel of a row needs exact 3 byte accesses.
+static stbi_inline __m128i stbi__png_load_pixel(const stbi_uc *p)
+{
+   stbi__uint32 v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128((int) v);
+}
+
+static stbi_inline void stbi__png_store_pixel(stbi_uc *p, __m128i v)
+{
+   stbi__uint32 t = (stbi__uint32) _mm_cvtsi128_si32(v);
+   memcpy(p, &t, 4);
+}
+
+static stbi_inline __m128i stbi__png_load_last(const stbi_uc *p, int bpp)
+{
+   stbi__uint32 v = p[0] | (p[1] << 8) | (p[2] << 16);
+   if (bpp == 4) v |= (stbi__uint32) p[3] << 24;
+   return _mm_cvtsi32_si128((int) v);
+}
+
+static stbi_inline void stbi__png_store_last(stbi_uc *p, __m128i v, int bpp)
+{
+   stbi__uint32 t = (stbi__uint32) _mm_cvtsi128_si32(v);
+   p[0] = STBI__BYTECAST(t);
+   p[1] = STBI__BYTECAST(t >> 8);
+   p[2] = STBI__BYTECAST(t >> 16);
+   if (bpp == 4) p[3] = STBI__BYTECAST(t >> 24);
+}
+
+static stbi_inline __m128i stbi__png_avg_pixel(__m128i a, __m128i b, __m128i raw)
+{
+   // floor((a+b)/2) is the rounded up pavgb minus the dropped low bit
+   __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+   return _mm_add_epi8(raw, avg);
+}
+
+// a, b and c are widened to 16 bits, the result is bytes
+static stbi_inline __m128i stbi__png_paeth_pixel(__m128i a, __m128i b, __m128i c, __m128i raw)
+{
+   const __m128i zero = _mm_setzero_si128();
+   __m128i pa = _mm_sub_epi16(b, c);
+   __m128i pb = _mm_sub_epi16(a, c);
+   __m128i pc = _mm_add_epi16(pa, pb);
+   __m128i not_a, use_c, bc, pred;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   // a unless pa loses to pb or pc, then b unless pc beats pb
+   not_a = _mm_cmpgt_epi16(pa, _mm_min_epi16(pb, pc));
+   use_c = _mm_cmpgt_epi16(pb, pc);
+   bc = _mm_or_si128(_mm_and_si128(use_c, c), _mm_andnot_si128(use_c, b));
+   pred = _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+   return _mm_add_epi8(raw, _mm_packus_epi16(pred, pred));
+}
+
+// Unfilters the nk bytes after the first pixel of an 8-bit row of 3 or 4
+// byte pixels; cur[-bpp..-1] already holds the first pixel. Up and sub cover
+// several pixels per step. Avg and paeth depend on the pixel to their left,
+// so they still go pixel by pixel, but a whole pixel at a time and without
+// the per-byte branches.
+static void stbi__png_unfilter_sse2(int filter, stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int nk, int bpp)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i pixel_mask = _mm_cvtsi32_si128(bpp == 4 ? -1 : 0xffffff);
+   __m128i a, c;
+   int k = 0;
+   if (nk <= 0) return;
+   switch (filter) {
+      case STBI__F_up:
+         for (; k + 16 <= nk; k += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (raw + k));
+            __m128i b = _mm_loadu_si128((const __m128i *) (prior + k));
+            _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(x, b));
+         }
+         for (; k < nk; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+         break;
+      case STBI__F_sub:
+         // the left pixel goes into the first lane, then a prefix sum over
+         // the register carries it through every pixel after it
+         a = _mm_and_si128(stbi__png_load_pixel(cur - bpp), pixel_mask);
+         if (bpp == 4) {
+            for (; k + 16 <= nk; k += 16) {
+               __m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw + k)), a);
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+               _mm_storeu_si128((__m128i *) (cur + k), x);
+               a = _mm_srli_si128(x, 12);
+            }
+         } else {
+            // five pixels per step; the 16th byte stored is redone by the next
+            for (; k + 16 <= nk; k += 15) {
+               __m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw + k)), a);
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 12));
+               _mm_storeu_si128((__m128i *) (cur + k), x);
+               a = _mm_and_si128(_mm_srli_si128(x, 12), pixel_mask);
+            }
+         }
+         for (; k < nk; ++k) cur[k] = STBI__BYTECAST(raw[k] + cur[k-bpp]);
+         break;
+      case STBI__F_avg:
+         a = stbi__png_load_pixel(cur - bpp);
+         for (; k < nk - bpp; k += bpp) {
+            a = stbi__png_avg_pixel(a, stbi__png_load_pixel(prior + k), stbi__png_load_pixel(raw + k));
+            stbi__png_store_pixel(cur + k, a);
+         }
+         a = stbi__png_avg_pixel(a, stbi__png_load_last(prior + k, bpp), stbi__png_load_last(raw + k, bpp));
+         stbi__png_store_last(cur + k, a, bpp);
+         break;
+      case STBI__F_paeth:
+         a = _mm_unpacklo_epi8(stbi__png_load_pixel(cur - bpp), zero);
+         c = _mm_unpacklo_epi8(stbi__png_load_pixel(prior - bpp), zero);
+         for (; k < nk - bpp; k += bpp) {
+            __m128i b = _mm_unpacklo_epi8(stbi__png_load_pixel(prior + k), zero);
+            __m128i x = stbi__png_paeth_pixel(a, b, c, stbi__png_load_pixel(raw + k));
+            stbi__png_store_pixel(cur + k, x);
+            a = _mm_unpacklo_epi8(x, zero);
+            c = b;
+         }
+         {
+            __m128i b = _mm_unpacklo_epi8(stbi__png_load_last(prior + k, bpp), zero);
+            stbi__png_store_last(cur + k, stbi__png_paeth_pixel(a, b, c, stbi__png_load_last(raw + k, bpp)), bpp);
+         }
+         break;
+   }
+}
+#endif // STBI_SSE2
+
+typedef struct stbi__png_pipeline stbi__png_pipeline;
+static int stbi__png_wait_rows(stbi__png_pipeline *p, unsigned int need);
+
 // create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// With `pipe`, raw is still being inflated and each row is waited for.
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, stbi__png_pipeline *pipe)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
@@ -4620,7 +5411,11 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    for (j=0; j < y; ++j) {
       stbi_uc *cur = a->out + stride*j;
       stbi_uc *prior;
-      int filter = *raw++;
+      int filter;
+
+      if (pipe && !stbi__png_wait_rows(pipe, (j+1) * (img_width_bytes+1)))
+         return stbi__err("not enough pixels","Corrupt PNG");
+      filter = *raw++;
 
       if (filter > 4)
          return stbi__err("invalid filter","Corrupt PNG");
@@ -4675,6 +5470,12 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          #define STBI__CASE(f) \
              case f:     \
                 for (k=0; k < nk; ++k)
+#ifdef STBI_SSE2
+         if (depth == 8 && (filter_bytes == 3 || filter_bytes == 4) &&
+             filter >= STBI__F_sub && filter <= STBI__F_paeth && stbi__sse2_available())
+            stbi__png_unfilter_sse2(filter, cur, prior, raw, nk, filter_bytes);
+         else
+#endif
          switch (filter) {
             // "none" filter turns into a memcpy here; make that explicit.
             case STBI__F_none:         memcpy(cur, raw, nk); break;
@@ -4810,7 +5611,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, NULL);
 
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
@@ -4826,7 +5627,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, NULL)) {
             STBI_FREE(final);
             return 0;
          }
@@ -4848,6 +5649,128 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
+// Inflate and unfiltering of a non-interlaced PNG as the two tasks of one
+// parallel_for. The inflater writes into a buffer sized for exactly the
+// filtered rows and publishes its progress every zout_step bytes; the
+// unfilter waits for each row. Whichever task reaches the inflate first runs
+// it, so the pair finishes however the two are scheduled, even one after the
+// other on the same thread.
+struct stbi__png_pipeline
+{
+   stbi__png *png;
+   stbi__zbuf zbuf;
+   stbi__uint32 img_len;
+   int parse_header, out_n, color, claimed, inflated, unfiltered;
+   unsigned int produced, finished;
+};
+
+static void stbi__png_pipeline_inflate(stbi__png_pipeline *p)
+{
+   int ok;
+#ifdef STBI__PIPELINE
+   if (__atomic_exchange_n(&p->claimed, 1, __ATOMIC_ACQ_REL)) return;
+#else
+   if (p->claimed) return;
+   p->claimed = 1;
+#endif
+   ok = stbi__parse_zlib(&p->zbuf, p->parse_header);
+   // trailing data past the image (issue #276) only overflows the buffer
+   if (!ok && p->zbuf.zout == p->zbuf.zout_limit) ok = 1;
+   p->inflated = ok;
+   stbi__publish_progress(&p->produced, (unsigned int) (p->zbuf.zout - p->zbuf.zout_start));
+   stbi__publish_progress(&p->finished, 1);
+}
+
+static int stbi__png_wait_rows(stbi__png_pipeline *p, unsigned int need)
+{
+   int spins = 0;
+   for (;;) {
+      if (stbi__read_progress(&p->produced) >= need) return 1;
+      if (stbi__read_progress(&p->finished)) return stbi__read_progress(&p->produced) >= need;
+#ifdef STBI__PIPELINE
+      if (!__atomic_load_n(&p->claimed, __ATOMIC_ACQUIRE)) stbi__png_pipeline_inflate(p);
+      // spin briefly, the next checkpoint is usually close; then give the
+      // inflater the CPU in case both tasks share one
+      if (++spins < 256) {
+#ifdef STBI_SSE2
+         _mm_pause();
+#endif
+      } else {
+         STBI__YIELD();
+      }
+#else
+      stbi__png_pipeline_inflate(p);
+#endif
+   }
+}
+
+static void stbi__png_pipeline_task(void *arg, int begin, int end)
+{
+   stbi__png_pipeline *p = (stbi__png_pipeline *) arg;
+   int k;
+   for (k = begin; k < end; ++k) {
+      if (k == 0) {
+         stbi__png_pipeline_inflate(p);
+      } else {
+         stbi__context *s = p->png->s;
+         p->unfiltered = stbi__create_png_image_raw(p->png, (stbi_uc *) p->zbuf.zout_start, p->img_len, p->out_n, s->img_x, s->img_y, p->png->depth, p->color, p);
+      }
+   }
+}
+
+// Inflates z->idata into z->expanded and unfilters it into z->out on two
+// threads. Returns 0, with nothing allocated, when it does not apply or
+// fails; the caller then takes the serial path, which also reports errors.
+static int stbi__png_inflate_unfilter(stbi__png *z, int idata_len, int parse_header, int out_n, int color, int interlace)
+{
+#ifdef STBI__PIPELINE
+   stbi__context *s = z->s;
+   stbi__png_pipeline p;
+   stbi__uint32 img_width_bytes;
+   char *buffer;
+   if (!stbi__parallel_for || interlace || !stbi__mad3sizes_valid(s->img_n, s->img_x, z->depth, 7))
+      return 0;
+   img_width_bytes = (((s->img_n * s->img_x * z->depth) + 7) >> 3);
+   if (!stbi__mad2sizes_valid((int) img_width_bytes + 1, s->img_y, 0))
+      return 0;
+   p.img_len = (img_width_bytes + 1) * s->img_y;
+   if (p.img_len < (1 << 18))
+      return 0;
+   buffer = (char *) stbi__malloc(p.img_len);
+   if (!buffer) return 0;
+
+   p.png = z;
+   p.zbuf.zbuffer = z->idata;
+   p.zbuf.zbuffer_end = z->idata + idata_len;
+   p.zbuf.zout_start = p.zbuf.zout = buffer;
+   p.zbuf.zout_limit = buffer + p.img_len;
+   p.zbuf.zout_step = 1 << 16;
+   p.zbuf.zout_end = buffer + p.zbuf.zout_step;
+   if (p.zbuf.zout_end > p.zbuf.zout_limit) p.zbuf.zout_end = p.zbuf.zout_limit;
+   p.zbuf.z_expandable = 0;
+   p.zbuf.zout_progress = &p.produced;
+   p.parse_header = parse_header;
+   p.out_n = out_n;
+   p.color = color;
+   p.claimed = p.inflated = p.unfiltered = 0;
+   p.produced = p.finished = 0;
+   stbi__parallel_for(stbi__parallel_user, stbi__png_pipeline_task, &p, 2);
+
+   if (!p.inflated || !p.unfiltered) {
+      STBI_FREE(buffer);
+      STBI_FREE(z->out);
+      z->out = NULL;
+      return 0;
+   }
+   z->expanded = (stbi_uc *) buffer;
+   return 1;
+#else
+   STBI_NOTUSED(z); STBI_NOTUSED(idata_len); STBI_NOTUSED(parse_header);
+   STBI_NOTUSED(out_n); STBI_NOTUSED(color); STBI_NOTUSED(interlace);
+   return 0;
+#endif
+}
+
 static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
 {
    stbi__context *s = z->s;
@@ -5137,17 +6060,21 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            if (stbi__png_inflate_unfilter(z, ioff, !is_iphone, s->img_out_n, color, interlace)) {
+               STBI_FREE(z->idata); z->idata = NULL;
+            } else {
+               // initial guess for decoded data size to avoid unnecessary reallocs
+               bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+               raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+               z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+               if (z->expanded == NULL) return 0; // zlib should set error
+               STBI_FREE(z->idata); z->idata = NULL;
+               if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            }
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -192,8 +192,24 @@ STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w,
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
 
+// Encodes planar YCbCr (JPEG range, as returned by stbi_load_jpeg_ycbcr_from_memory)
+// without any color conversion. planes[0] is x by y luma; with `subsampled`
+// the Cb and Cr planes are (x+1)/2 by (y+1)/2 and the file is 4:2:0,
+// otherwise they are full size and the file is 4:4:4. strides are in bytes.
+STBIWDEF int stbi_write_jpg_ycbcr_to_func(stbi_write_func *func, void *context, int x, int y, const unsigned char *const planes[3], const int strides[3], int subsampled, int quality);
+
 STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
+// Lets the PNG writer split work over the caller's threads, the same contract
+// as stbi_set_parallel_for in stb_image: `func` must run task(arg, begin, end)
+// over disjoint ranges covering [0, count) and return once all of them are
+// done. With it set, PNG rows are filtered in parallel and the image data is
+// deflated in independent bands joined by full flushes (like pigz), which
+// costs a little compression at each band boundary.
+typedef void stbiw_parallel_task(void *arg, int begin, int end);
+typedef void stbiw_parallel_for_func(void *user, stbiw_parallel_task *task, void *arg, int count);
+STBIWDEF void stbi_write_set_parallel_for(stbiw_parallel_for_func *func, void *user);
+
 #endif//INCLUDE_STB_IMAGE_WRITE_H
 
 #ifdef STB_IMAGE_WRITE_IMPLEMENTATION
@@ -247,6 +263,14 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #define STBIW_UCHAR(x) (unsigned char) ((x) & 0xff)
 
+// With GCC or Clang on x86 the PNG filters and the JPEG color conversion and
+// DCT have AVX2 versions, compiled with target attributes and picked at run
+// time; define STBIW_NO_AVX2 to leave them out.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(STBIW_NO_AVX2)
+#define STBIW__AVX_DISPATCH
+#include <immintrin.h>
+#endif
+
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
@@ -264,6 +288,24 @@ STBIWDEF void stbi_flip_vertically_on_write(int flag)
    stbi__flip_vertically_on_write = flag;
 }
 
+static stbiw_parallel_for_func *stbiw__parallel_for = NULL;
+static void *stbiw__parallel_user = NULL;
+
+STBIWDEF void stbi_write_set_parallel_for(stbiw_parallel_for_func *func, void *user)
+{
+   stbiw__parallel_for = func;
+   stbiw__parallel_user = user;
+}
+
+// runs the whole range on the calling thread when no parallel_for is set
+static void stbiw__run_parallel(stbiw_parallel_task *task, void *arg, int count)
+{
+   if (stbiw__parallel_for && count > 1)
+      stbiw__parallel_for(stbiw__parallel_user, task, arg, count);
+   else if (count > 0)
+      task(arg, 0, count);
+}
+
 typedef struct
 {
    stbi_write_func *func;
@@ -890,36 +932,46 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #define stbiw__ZHASH   16384
 
-#endif // STBIW_ZLIB_COMPRESS
-
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// Deflates data[begin, end) onto `out` as fixed Huffman blocks, matching
+// against everything from data[begin-32768] on, so a band can continue the
+// window of the one before it. The last block is final when `last` is set;
+// otherwise the band ends on an empty stored block, a byte aligned full flush
+// after which the next band can start a block of its own. Stored blocks are
+// used instead when compression would grow the band.
+static unsigned char *stbiw__zlib_deflate_band(unsigned char *out, unsigned char *data, int begin, int end, int quality, int last)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
-   unsigned char *out = NULL;
+   int start = stbiw__sbcount(out), len = end - begin;
    unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
-   if (hash_table == NULL)
+   if (hash_table == NULL) {
+      (void) stbiw__sbfree(out);
       return NULL;
+   }
    if (quality < 5) quality = 5;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(last ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
    for (i=0; i < stbiw__ZHASH; ++i)
       hash_table[i] = NULL;
 
-   i=0;
-   while (i < data_len-3) {
+   // prime the hash chains with the window the previous band left behind
+   for (i = begin > 32768 ? begin-32768 : 0; i < begin && i < end-3; ++i) {
+      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1);
+      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
+         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
+         stbiw__sbn(hash_table[h]) = quality;
+      }
+      stbiw__sbpush(hash_table[h],data+i);
+   }
+
+   i=begin;
+   while (i < end-3) {
       // hash next 3 bytes of data to be compressed
       int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
       unsigned char *bestloc = 0;
@@ -927,7 +979,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       int n = stbiw__sbcount(hlist);
       for (j=0; j < n; ++j) {
          if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
+            int d = stbiw__zlib_countm(hlist[j], data+i, end-i);
             if (d >= best) { best=d; bestloc=hlist[j]; }
          }
       }
@@ -945,7 +997,7 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          n = stbiw__sbcount(hlist);
          for (j=0; j < n; ++j) {
             if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
+               int e = stbiw__zlib_countm(hlist[j], data+i+1, end-i-1);
                if (e > best) { // if next match is better, bail on current match
                   bestloc = NULL;
                   break;
@@ -970,57 +1022,180 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
       }
    }
    // write out final bytes
-   for (;i < data_len; ++i)
+   for (;i < end; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
+   if (!last) {
+      stbiw__zlib_add(0,1);  // BFINAL = 0
+      stbiw__zlib_add(0,2);  // BTYPE = 0 -- empty stored block
+   }
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
+   if (!last) {
+      stbiw__sbpush(out, 0);
+      stbiw__sbpush(out, 0);
+      stbiw__sbpush(out, 0xff);
+      stbiw__sbpush(out, 0xff);
+   }
 
    for (i=0; i < stbiw__ZHASH; ++i)
       (void) stbiw__sbfree(hash_table[i]);
    STBIW_FREE(hash_table);
 
    // store uncompressed instead if compression was worse
-   if (stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
-      stbiw__sbn(out) = 2;  // truncate to DEFLATE 32K window and FLEVEL = 1
-      for (j = 0; j < data_len;) {
-         int blocklen = data_len - j;
+   if (stbiw__sbn(out) - start > len + ((len+32766)/32767)*5) {
+      stbiw__sbn(out) = start;
+      for (j = begin; j < end;) {
+         int blocklen = end - j;
          if (blocklen > 32767) blocklen = 32767;
-         stbiw__sbpush(out, data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
+         stbiw__sbpush(out, last && end - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
          stbiw__sbpush(out, STBIW_UCHAR(blocklen)); // LEN
          stbiw__sbpush(out, STBIW_UCHAR(blocklen >> 8));
          stbiw__sbpush(out, STBIW_UCHAR(~blocklen)); // NLEN
          stbiw__sbpush(out, STBIW_UCHAR(~blocklen >> 8));
+         stbiw__sbmaybegrow(out, blocklen);
          memcpy(out+stbiw__sbn(out), data+j, blocklen);
          stbiw__sbn(out) += blocklen;
          j += blocklen;
       }
    }
+   return out;
+}
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int s1=1, s2=0;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+   return (s2 << 16) | s1;
+}
+
+// Adler-32 of A followed by B, from the checksums of both and B's length.
+static unsigned int stbiw__adler32_combine(unsigned int a, unsigned int b, int b_len)
+{
+   unsigned int rem = (unsigned int) b_len % 65521;
+   unsigned int s1 = a & 0xffff;
+   unsigned int s2 = (rem * s1) % 65521;
+   s1 += (b & 0xffff) + 65521 - 1;
+   s2 += (a >> 16) + (b >> 16) + 65521 - rem;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s1 >= 65521) s1 -= 65521;
+   if (s2 >= 2*65521) s2 -= 2*65521;
+   if (s2 >= 65521) s2 -= 65521;
+   return (s2 << 16) | s1;
+}
+
+static unsigned char *stbiw__zlib_finish(unsigned char *out, unsigned int adler, int *out_len)
+{
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
    return (unsigned char *) stbiw__sbraw(out);
+}
+
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned char *out = NULL;
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   out = stbiw__zlib_deflate_band(out, data, 0, data_len, quality, 1);
+   if (!out) return NULL;
+   return stbiw__zlib_finish(out, stbiw__adler32(data, data_len), out_len);
 #endif // STBIW_ZLIB_COMPRESS
 }
 
+#ifndef STBIW_ZLIB_COMPRESS
+// input bytes per independently deflated band
+#define STBIW__ZBAND   (1 << 19)
+
+typedef struct
+{
+   unsigned char *data;
+   int data_len, quality, bands;
+   unsigned char **out;
+   unsigned int *adler;
+} stbiw__zlib_job;
+
+static void stbiw__zlib_deflate_bands(void *arg, int begin, int end)
+{
+   stbiw__zlib_job *job = (stbiw__zlib_job *) arg;
+   int k;
+   for (k = begin; k < end; ++k) {
+      int from = k * STBIW__ZBAND;
+      int to = k == job->bands-1 ? job->data_len : from + STBIW__ZBAND;
+      job->out[k] = stbiw__zlib_deflate_band(NULL, job->data, from, to, job->quality, k == job->bands-1);
+      job->adler[k] = stbiw__adler32(job->data + from, to - from);
+   }
+}
+#endif
+
+// stbi_zlib_compress, spread over the parallel_for when one is set: bands
+// of the input are deflated and checksummed on their own, then the pieces
+// are concatenated behind one zlib header and their Adler-32s combined.
+static unsigned char *stbiw__zlib_compress_parallel(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   return stbi_zlib_compress(data, data_len, out_len, quality);
+#else
+   stbiw__zlib_job job;
+   unsigned char *out = NULL;
+   unsigned int adler;
+   int k, total = 0, failed = 0;
+   if (!stbiw__parallel_for || data_len <= STBIW__ZBAND)
+      return stbi_zlib_compress(data, data_len, out_len, quality);
+
+   job.data = data;
+   job.data_len = data_len;
+   job.quality = quality;
+   job.bands = (data_len + STBIW__ZBAND - 1) / STBIW__ZBAND;
+   job.out = (unsigned char **) STBIW_MALLOC(job.bands * (sizeof(*job.out) + sizeof(*job.adler)));
+   if (!job.out) return NULL;
+   job.adler = (unsigned int *) (job.out + job.bands);
+   stbiw__run_parallel(stbiw__zlib_deflate_bands, &job, job.bands);
+
+   for (k = 0; k < job.bands; ++k) {
+      if (job.out[k]) total += stbiw__sbn(job.out[k]);
+      else failed = 1;
+   }
+   if (!failed) {
+      stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+      stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+      stbiw__sbmaybegrow(out, total + 4);
+   }
+   adler = job.adler[0];
+   for (k = 0; k < job.bands; ++k) {
+      if (!failed) {
+         memcpy(out + stbiw__sbn(out), job.out[k], stbiw__sbn(job.out[k]));
+         stbiw__sbn(out) += stbiw__sbn(job.out[k]);
+      }
+      if (k > 0) {
+         int len = k == job.bands-1 ? data_len - k * STBIW__ZBAND : STBIW__ZBAND;
+         adler = stbiw__adler32_combine(adler, job.adler[k], len);
+      }
+      (void) stbiw__sbfree(job.out[k]);
+   }
+   STBIW_FREE(job.out);
+   if (failed) return NULL;
+   return stbiw__zlib_finish(out, adler, out_len);
+#endif
+}
+
 static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 {
 #ifdef STBIW_CRC32
@@ -1088,15 +1263,74 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
+#ifdef STBIW__AVX_DISPATCH
+// Paeth filter of bytes [i, len) of a line, 16 at a time in 16-bit lanes;
+// returns where it stopped, for the scalar loop to finish the tail.
+__attribute__((target("avx2")))
+static int stbiw__paeth_line_avx2(const unsigned char *z, const unsigned char *up, int i, int n, int len, signed char *line_buffer)
+{
+   const __m256i lo = _mm256_set1_epi16(0xff);
+   for (; i + 16 <= len; i += 16) {
+      __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (z + i - n)));
+      __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (up + i)));
+      __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (up + i - n)));
+      __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (z + i)));
+      __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+      __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+      __m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+      // a unless pa loses to pb or pc, then b unless pc beats pb
+      __m256i bc = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+      __m256i pred = _mm256_blendv_epi8(a, bc, _mm256_cmpgt_epi16(pa, _mm256_min_epi16(pb, pc)));
+      __m256i d = _mm256_and_si256(_mm256_sub_epi16(x, pred), lo);
+      d = _mm256_permute4x64_epi64(_mm256_packus_epi16(d, d), 0xd8);
+      _mm_storeu_si128((__m128i *) (line_buffer + i), _mm256_castsi256_si128(d));
+   }
+   return i;
+}
+
+// sum of |v| over a filtered line, the filter selection heuristic
+__attribute__((target("avx2")))
+static int stbiw__png_line_cost_avx2(const signed char *line, int len)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   __m256i sum = zero;
+   int i = 0, est;
+   for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (line + i));
+      sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(v), zero));
+   }
+   {
+      __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+      est = (int) (_mm_cvtsi128_si32(s) + _mm_extract_epi32(s, 2));
+   }
+   for (; i < len; ++i)
+      est += abs(line[i]);
+   return est;
+}
+#endif
+
+static int stbiw__png_line_cost(const signed char *line, int len, int avx2)
+{
+   int i, est = 0;
+#ifdef STBIW__AVX_DISPATCH
+   if (avx2) return stbiw__png_line_cost_avx2(line, len);
+#else
+   (void) avx2;
+#endif
+   for (i = 0; i < len; ++i)
+      est += abs(line[i]);
+   return est;
+}
+
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+static void stbiw__encode_png_line(const unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer, int avx2)
 {
    static int mapping[] = { 0,1,2,3,4 };
    static int firstmap[] = { 0,1,0,5,6 };
    int *mymap = (y != 0) ? mapping : firstmap;
    int i;
    int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
+   const unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
    int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
 
    if (type==0) {
@@ -1119,61 +1353,95 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
       case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
       case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
       case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
+      case 4:
+         i = n;
+#ifdef STBIW__AVX_DISPATCH
+         if (avx2) i = stbiw__paeth_line_avx2(z, z-signed_stride, n, n, width*n, line_buffer);
+#endif
+         for (; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]);
+         break;
       case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
       case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+typedef struct
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
-
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
-
-   if (force_filter >= 5) {
-      force_filter = -1;
-   }
-
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+   const unsigned char *pixels;
+   int stride_bytes, x, y, n, force_filter, avx2, failed;
+   unsigned char *filt;
+} stbiw__png_filter_job;
+
+// Filters rows [begin, end) into their slots of the IDAT payload; rows only
+// read the source, so any split of them gives the same bytes.
+static void stbiw__png_filter_rows(void *arg, int begin, int end)
+{
+   stbiw__png_filter_job *job = (stbiw__png_filter_job *) arg;
+   int x = job->x, n = job->n, j;
+   signed char *line_buffer = (signed char *) STBIW_MALLOC(x * n);
+   if (!line_buffer) { job->failed = 1; return; }
+   for (j=begin; j < end; ++j) {
       int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
+      if (job->force_filter > -1) {
+         filter_type = job->force_filter;
+         stbiw__encode_png_line(job->pixels, job->stride_bytes, x, job->y, j, n, job->force_filter, line_buffer, job->avx2);
       } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+         int best_filter = 0, best_filter_val = 0x7fffffff, est;
          for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
+            stbiw__encode_png_line(job->pixels, job->stride_bytes, x, job->y, j, n, filter_type, line_buffer, job->avx2);
 
             // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
+            est = stbiw__png_line_cost(line_buffer, x*n, job->avx2);
             if (est < best_filter_val) {
                best_filter_val = est;
                best_filter = filter_type;
             }
          }
          if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
+            stbiw__encode_png_line(job->pixels, job->stride_bytes, x, job->y, j, n, best_filter, line_buffer, job->avx2);
             filter_type = best_filter;
          }
       }
       // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      job->filt[j*(x*n+1)] = (unsigned char) filter_type;
+      STBIW_MEMMOVE(job->filt+j*(x*n+1)+1, line_buffer, x*n);
    }
    STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   int force_filter = stbi_write_force_png_filter;
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o, *filt, *zlib;
+   stbiw__png_filter_job job;
+   int zlen;
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+   job.pixels = pixels;
+   job.stride_bytes = stride_bytes;
+   job.x = x;
+   job.y = y;
+   job.n = n;
+   job.force_filter = force_filter;
+#ifdef STBIW__AVX_DISPATCH
+   job.avx2 = __builtin_cpu_supports("avx2");
+#else
+   job.avx2 = 0;
+#endif
+   job.failed = 0;
+   job.filt = filt;
+   stbiw__run_parallel(stbiw__png_filter_rows, &job, y);
+   if (job.failed) { STBIW_FREE(filt); return 0; }
+   zlib = stbiw__zlib_compress_parallel(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
    STBIW_FREE(filt);
    if (!zlib) return 0;
 
@@ -1247,24 +1515,80 @@ STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x,
  * public domain Simple, Minimalistic JPEG writer - http://www.jonolick.com/code.html
  */
 
+// The AVX2 color conversion and DCT only match the scalar code bit for bit
+// if neither side fuses multiplies and adds, so contraction is off for the
+// whole JPEG writer.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
 static const unsigned char stbiw__jpg_ZigZag[] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,
       24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
 
-static void stbiw__jpg_writeBits(stbi__write_context *s, int *bitBufP, int *bitCntP, const unsigned short *bs) {
-   int bitBuf = *bitBufP, bitCnt = *bitCntP;
-   bitCnt += bs[1];
-   bitBuf |= bs[0] << (24 - bitCnt);
-   while(bitCnt >= 8) {
-      unsigned char c = (bitBuf >> 16) & 255;
-      stbiw__putc(s, c);
-      if(c == 255) {
-         stbiw__putc(s, 0);
+// Bits collect in a 64-bit accumulator and leave it 32 at a time, 0xFF
+// stuffed, into a local buffer that goes to the write callback in large
+// pieces rather than one call per byte.
+typedef struct
+{
+   stbi__write_context *s;
+   unsigned long long acc; // the low `bits` bits are pending, MSB first
+   int bits;
+   int used;
+   unsigned char buf[4096 + 8];
+} stbiw__jpg_bitwriter;
+
+static void stbiw__jpg_flushBytes(stbiw__jpg_bitwriter *bw) {
+   if(bw->used) {
+      bw->s->func(bw->s->context, bw->buf, bw->used);
+      bw->used = 0;
+   }
+}
+
+static void stbiw__jpg_emitByte(stbiw__jpg_bitwriter *bw, unsigned char c) {
+   bw->buf[bw->used++] = c;
+   if(c == 255) {
+      bw->buf[bw->used++] = 0;
+   }
+}
+
+static void stbiw__jpg_writeBits(stbiw__jpg_bitwriter *bw, const unsigned short *bs) {
+   bw->acc = (bw->acc << bs[1]) | bs[0];
+   bw->bits += bs[1];
+   if(bw->bits >= 32) {
+      unsigned int word = (unsigned int) (bw->acc >> (bw->bits - 32));
+      bw->bits -= 32;
+      if(((~word - 0x01010101u) & word & 0x80808080u) == 0) {
+         // no 0xFF byte, nothing to stuff
+         bw->buf[bw->used+0] = (unsigned char) (word >> 24);
+         bw->buf[bw->used+1] = (unsigned char) (word >> 16);
+         bw->buf[bw->used+2] = (unsigned char) (word >> 8);
+         bw->buf[bw->used+3] = (unsigned char) word;
+         bw->used += 4;
+      } else {
+         stbiw__jpg_emitByte(bw, (unsigned char) (word >> 24));
+         stbiw__jpg_emitByte(bw, (unsigned char) (word >> 16));
+         stbiw__jpg_emitByte(bw, (unsigned char) (word >> 8));
+         stbiw__jpg_emitByte(bw, (unsigned char) word);
+      }
+      if(bw->used >= 4096) {
+         stbiw__jpg_flushBytes(bw);
       }
-      bitBuf <<= 8;
-      bitCnt -= 8;
    }
-   *bitBufP = bitBuf;
-   *bitCntP = bitCnt;
+}
+
+// Do the bit alignment of the EOI marker and hand over what is left
+static void stbiw__jpg_finishBits(stbiw__jpg_bitwriter *bw) {
+   static const unsigned short fillBits[] = {0x7F, 7};
+   stbiw__jpg_writeBits(bw, fillBits);
+   while(bw->bits >= 8) {
+      bw->bits -= 8;
+      stbiw__jpg_emitByte(bw, (unsigned char) (bw->acc >> bw->bits));
+   }
+   bw->bits = 0;
+   stbiw__jpg_flushBytes(bw);
 }
 
 static void stbiw__jpg_DCT(float *d0p, float *d1p, float *d2p, float *d3p, float *d4p, float *d5p, float *d6p, float *d7p) {
@@ -1325,11 +1649,14 @@ static void stbiw__jpg_calcBits(int val, unsigned short bits[2]) {
    bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt, float *CDU, int du_stride, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-   int dataOff, i, j, n, diff, end0pos, x, y;
-   int DU[64];
+// natural order index of every zigzag position
+static const unsigned char stbiw__jpg_UnZigZag[] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,
+      35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
+
+// forward DCT (in place, rows du_stride floats apart) and quantization of one
+// block; coefficient k in natural order goes to out[k*out_stride]
+static void stbiw__jpg_quantizeDU(float *CDU, int du_stride, const float *fdtbl, short *out, int out_stride) {
+   int dataOff, n, x, y, j;
 
    // DCT rows
    for(dataOff=0, n=du_stride*8; dataOff<n; dataOff+=du_stride) {
@@ -1340,27 +1667,46 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
       stbiw__jpg_DCT(&CDU[dataOff], &CDU[dataOff+du_stride], &CDU[dataOff+du_stride*2], &CDU[dataOff+du_stride*3], &CDU[dataOff+du_stride*4],
                      &CDU[dataOff+du_stride*5], &CDU[dataOff+du_stride*6], &CDU[dataOff+du_stride*7]);
    }
-   // Quantize/descale/zigzag the coefficients
+   // Quantize/descale the coefficients
    for(y = 0, j=0; y < 8; ++y) {
       for(x = 0; x < 8; ++x,++j) {
-         float v;
-         i = y*du_stride+x;
-         v = CDU[i]*fdtbl[j];
-         // DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+         float v = CDU[y*du_stride+x]*fdtbl[j];
          // ceilf() and floorf() are C99, not C89, but I /think/ they're not needed here anyway?
-         DU[stbiw__jpg_ZigZag[j]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+         out[j*out_stride] = (short) (int) (v < 0 ? v - 0.5f : v + 0.5f);
       }
    }
+}
+
+// Blocks are transformed in groups of 8 horizontally adjacent ones; the
+// quantized group is stored interleaved, coefficient k of block b at
+// out[k*8+b], which is the natural layout when every SIMD lane is a block.
+static void stbiw__jpg_quantize8(float *blocks, int stride, const float *fdtbl, short *out) {
+   int b;
+   for(b = 0; b < 8; ++b) {
+      stbiw__jpg_quantizeDU(blocks + 8*b, stride, fdtbl, out + b, 8);
+   }
+}
+
+// Huffman codes one quantized block, coefficient k at coef[k*stride]
+static int stbiw__jpg_encodeDU(stbiw__jpg_bitwriter *bw, const short *coef, int stride, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+   const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+   const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+   int i, diff, end0pos;
+   int DU[64];
+
+   for(i = 0; i < 64; ++i) {
+      DU[i] = coef[stbiw__jpg_UnZigZag[i]*stride];
+   }
 
    // Encode DC
    diff = DU[0] - DC;
    if (diff == 0) {
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTDC[0]);
+      stbiw__jpg_writeBits(bw, HTDC[0]);
    } else {
       unsigned short bits[2];
       stbiw__jpg_calcBits(diff, bits);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTDC[bits[1]]);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, bits);
+      stbiw__jpg_writeBits(bw, HTDC[bits[1]]);
+      stbiw__jpg_writeBits(bw, bits);
    }
    // Encode ACs
    end0pos = 63;
@@ -1368,7 +1714,7 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
    }
    // end0pos = first element in reverse order !=0
    if(end0pos == 0) {
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, EOB);
+      stbiw__jpg_writeBits(bw, EOB);
       return DU[0];
    }
    for(i = 1; i <= end0pos; ++i) {
@@ -1382,20 +1728,176 @@ static int stbiw__jpg_processDU(stbi__write_context *s, int *bitBuf, int *bitCnt
          int lng = nrzeroes>>4;
          int nrmarker;
          for (nrmarker=1; nrmarker <= lng; ++nrmarker)
-            stbiw__jpg_writeBits(s, bitBuf, bitCnt, M16zeroes);
+            stbiw__jpg_writeBits(bw, M16zeroes);
          nrzeroes &= 15;
       }
       stbiw__jpg_calcBits(DU[i], bits);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, HTAC[(nrzeroes<<4)+bits[1]]);
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, bits);
+      stbiw__jpg_writeBits(bw, HTAC[(nrzeroes<<4)+bits[1]]);
+      stbiw__jpg_writeBits(bw, bits);
    }
    if(end0pos != 63) {
-      stbiw__jpg_writeBits(s, bitBuf, bitCnt, EOB);
+      stbiw__jpg_writeBits(bw, EOB);
    }
    return DU[0];
 }
 
-static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data, int quality) {
+// converts a row of pixels to the centered Y, U, V the DCT works on
+static void stbiw__jpg_rgb_row(float *Y, float *U, float *V, const unsigned char *row, int width, int comp) {
+   // comp == 2 is grey+alpha (alpha is ignored)
+   int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
+   int col;
+   for(col = 0; col < width; ++col, row += comp) {
+      float r = row[0], g = row[ofsG], b = row[ofsB];
+      Y[col]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
+      U[col]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
+      V[col]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
+   }
+}
+
+// one row of an 8-bit plane, centered, then the last sample repeated up to `padded`
+static void stbiw__jpg_plane_row(float *dst, const unsigned char *src, int width, int padded) {
+   int col;
+   for(col = 0; col < width; ++col) {
+      dst[col] = src[col] - 128.0f;
+   }
+   for(; col < padded; ++col) {
+      dst[col] = dst[width-1];
+   }
+}
+
+#ifdef STBIW__AVX_DISPATCH
+// AVX2 versions: the color conversion does 8 pixels per step and the DCT runs
+// with one block per lane, 8 blocks at a time, using the very same operations
+// in the same order as the scalar code, so the output is bit-identical.
+
+__attribute__((target("avx2")))
+static void stbiw__jpg_rgb_row_avx2(float *Y, float *U, float *V, const unsigned char *row, int width, int comp) {
+   int col = 0;
+   if(comp == 3) {
+      const __m128i r_lo = _mm_setr_epi8(0,3,6,9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i r_hi = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,2,5,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i g_lo = _mm_setr_epi8(1,4,7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i g_hi = _mm_setr_epi8(-1,-1,-1,-1,-1,0,3,6,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i b_lo = _mm_setr_epi8(2,5,8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m128i b_hi = _mm_setr_epi8(-1,-1,-1,-1,-1,1,4,7,-1,-1,-1,-1,-1,-1,-1,-1);
+      const __m256 y_r = _mm256_set1_ps(0.29900f), y_g = _mm256_set1_ps(0.58700f), y_b = _mm256_set1_ps(0.11400f);
+      const __m256 u_r = _mm256_set1_ps(-0.16874f), u_g = _mm256_set1_ps(0.33126f), u_b = _mm256_set1_ps(0.50000f);
+      const __m256 v_r = _mm256_set1_ps(0.50000f), v_g = _mm256_set1_ps(0.41869f), v_b = _mm256_set1_ps(0.08131f);
+      const __m256 bias = _mm256_set1_ps(128.0f);
+      for(; col + 8 <= width; col += 8) {
+         // 8 pixels are exactly 24 bytes: 16 + 8
+         const unsigned char *p = row + col*3;
+         __m128i lo = _mm_loadu_si128((const __m128i *) p);
+         __m128i hi = _mm_loadl_epi64((const __m128i *) (p + 16));
+         __m256 r = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi))));
+         __m256 g = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi))));
+         __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi))));
+         _mm256_storeu_ps(Y + col, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y_r, r), _mm256_mul_ps(y_g, g)), _mm256_mul_ps(y_b, b)), bias));
+         _mm256_storeu_ps(U + col, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(u_r, r), _mm256_mul_ps(u_g, g)), _mm256_mul_ps(u_b, b)));
+         _mm256_storeu_ps(V + col, _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(v_r, r), _mm256_mul_ps(v_g, g)), _mm256_mul_ps(v_b, b)));
+      }
+   }
+   stbiw__jpg_rgb_row(Y + col, U + col, V + col, row + col*comp, width - col, comp);
+}
+
+__attribute__((target("avx2")))
+static inline void stbiw__jpg_DCT_avx2(__m256 *d, int stride) {
+   __m256 d0 = d[0], d1 = d[stride], d2 = d[stride*2], d3 = d[stride*3], d4 = d[stride*4], d5 = d[stride*5], d6 = d[stride*6], d7 = d[stride*7];
+   __m256 z1, z2, z3, z4, z5, z11, z13;
+
+   __m256 tmp0 = _mm256_add_ps(d0, d7);
+   __m256 tmp7 = _mm256_sub_ps(d0, d7);
+   __m256 tmp1 = _mm256_add_ps(d1, d6);
+   __m256 tmp6 = _mm256_sub_ps(d1, d6);
+   __m256 tmp2 = _mm256_add_ps(d2, d5);
+   __m256 tmp5 = _mm256_sub_ps(d2, d5);
+   __m256 tmp3 = _mm256_add_ps(d3, d4);
+   __m256 tmp4 = _mm256_sub_ps(d3, d4);
+
+   // Even part
+   __m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+   __m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+   __m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+   __m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+   d[0]        = _mm256_add_ps(tmp10, tmp11);
+   d[stride*4] = _mm256_sub_ps(tmp10, tmp11);
+
+   z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), _mm256_set1_ps(0.707106781f));
+   d[stride*2] = _mm256_add_ps(tmp13, z1);
+   d[stride*6] = _mm256_sub_ps(tmp13, z1);
+
+   // Odd part
+   tmp10 = _mm256_add_ps(tmp4, tmp5);
+   tmp11 = _mm256_add_ps(tmp5, tmp6);
+   tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+   z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), _mm256_set1_ps(0.382683433f));
+   z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, _mm256_set1_ps(0.541196100f)), z5);
+   z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, _mm256_set1_ps(1.306562965f)), z5);
+   z3 = _mm256_mul_ps(tmp11, _mm256_set1_ps(0.707106781f));
+
+   z11 = _mm256_add_ps(tmp7, z3);
+   z13 = _mm256_sub_ps(tmp7, z3);
+
+   d[stride*5] = _mm256_add_ps(z13, z2);
+   d[stride*3] = _mm256_sub_ps(z13, z2);
+   d[stride*1] = _mm256_add_ps(z11, z4);
+   d[stride*7] = _mm256_sub_ps(z11, z4);
+}
+
+__attribute__((target("avx2")))
+static void stbiw__jpg_quantize8_avx2(float *blocks, int stride, const float *fdtbl, short *out) {
+   __m256 t[64];
+   const __m256 sign = _mm256_set1_ps(-0.0f), half = _mm256_set1_ps(0.5f);
+   int r, k;
+   // row r of the 8 blocks, transposed so that lane b is block b
+   for(r = 0; r < 8; ++r) {
+      const float *p = blocks + r*stride;
+      __m256 a0 = _mm256_unpacklo_ps(_mm256_loadu_ps(p +  0), _mm256_loadu_ps(p +  8));
+      __m256 a1 = _mm256_unpackhi_ps(_mm256_loadu_ps(p +  0), _mm256_loadu_ps(p +  8));
+      __m256 a2 = _mm256_unpacklo_ps(_mm256_loadu_ps(p + 16), _mm256_loadu_ps(p + 24));
+      __m256 a3 = _mm256_unpackhi_ps(_mm256_loadu_ps(p + 16), _mm256_loadu_ps(p + 24));
+      __m256 a4 = _mm256_unpacklo_ps(_mm256_loadu_ps(p + 32), _mm256_loadu_ps(p + 40));
+      __m256 a5 = _mm256_unpackhi_ps(_mm256_loadu_ps(p + 32), _mm256_loadu_ps(p + 40));
+      __m256 a6 = _mm256_unpacklo_ps(_mm256_loadu_ps(p + 48), _mm256_loadu_ps(p + 56));
+      __m256 a7 = _mm256_unpackhi_ps(_mm256_loadu_ps(p + 48), _mm256_loadu_ps(p + 56));
+      __m256 b0 = _mm256_shuffle_ps(a0, a2, _MM_SHUFFLE(1,0,1,0));
+      __m256 b1 = _mm256_shuffle_ps(a0, a2, _MM_SHUFFLE(3,2,3,2));
+      __m256 b2 = _mm256_shuffle_ps(a1, a3, _MM_SHUFFLE(1,0,1,0));
+      __m256 b3 = _mm256_shuffle_ps(a1, a3, _MM_SHUFFLE(3,2,3,2));
+      __m256 b4 = _mm256_shuffle_ps(a4, a6, _MM_SHUFFLE(1,0,1,0));
+      __m256 b5 = _mm256_shuffle_ps(a4, a6, _MM_SHUFFLE(3,2,3,2));
+      __m256 b6 = _mm256_shuffle_ps(a5, a7, _MM_SHUFFLE(1,0,1,0));
+      __m256 b7 = _mm256_shuffle_ps(a5, a7, _MM_SHUFFLE(3,2,3,2));
+      t[r*8+0] = _mm256_permute2f128_ps(b0, b4, 0x20);
+      t[r*8+1] = _mm256_permute2f128_ps(b1, b5, 0x20);
+      t[r*8+2] = _mm256_permute2f128_ps(b2, b6, 0x20);
+      t[r*8+3] = _mm256_permute2f128_ps(b3, b7, 0x20);
+      t[r*8+4] = _mm256_permute2f128_ps(b0, b4, 0x31);
+      t[r*8+5] = _mm256_permute2f128_ps(b1, b5, 0x31);
+      t[r*8+6] = _mm256_permute2f128_ps(b2, b6, 0x31);
+      t[r*8+7] = _mm256_permute2f128_ps(b3, b7, 0x31);
+   }
+   for(r = 0; r < 8; ++r) {
+      stbiw__jpg_DCT_avx2(t + r*8, 1);
+   }
+   for(r = 0; r < 8; ++r) {
+      stbiw__jpg_DCT_avx2(t + r, 8);
+   }
+   for(k = 0; k < 64; ++k) {
+      // v < 0 ? v - 0.5f : v + 0.5f, then truncate
+      __m256 v = _mm256_mul_ps(t[k], _mm256_set1_ps(fdtbl[k]));
+      __m256i q = _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_or_ps(_mm256_and_ps(v, sign), half)));
+      _mm_storeu_si128((__m128i *) (out + k*8), _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1)));
+   }
+}
+#endif // STBIW__AVX_DISPATCH
+
+// `planes` switches the input from interleaved `data` to Y, Cb, Cr planes;
+// force_subsample < 0 picks 4:2:0 from the quality like upstream does
+static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, int comp, const void* data,
+                               const unsigned char *const *planes, const int *strides, int force_subsample, int quality) {
    // Constants that don't pollute global namespace
    static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
    static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
@@ -1471,12 +1973,15 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    float fdtbl_Y[64], fdtbl_UV[64];
    unsigned char YTable[64], UVTable[64];
 
-   if(!data || !width || !height || comp > 4 || comp < 1) {
+   if(planes ? !strides : (!data || comp > 4 || comp < 1)) {
+      return 0;
+   }
+   if(!width || !height) {
       return 0;
    }
 
    quality = quality ? quality : 90;
-   subsample = quality <= 90 ? 1 : 0;
+   subsample = force_subsample >= 0 ? force_subsample : quality <= 90 ? 1 : 0;
    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
 
@@ -1519,82 +2024,127 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
       s->func(s->context, (void*)head2, sizeof(head2));
    }
 
-   // Encode 8x8 macroblocks
+   // Encode 8x8 macroblocks, one row of MCUs at a time: the rows become
+   // float planes, every block of the strip is transformed and quantized in
+   // groups of 8, then the blocks are entropy coded in MCU order.
    {
-      static const unsigned short fillBits[] = {0x7F, 7};
       int DCY=0, DCU=0, DCV=0;
-      int bitBuf=0, bitCnt=0;
-      // comp == 2 is grey+alpha (alpha is ignored)
-      int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
-      const unsigned char *dataR = (const unsigned char *)data;
-      const unsigned char *dataG = dataR + ofsG;
-      const unsigned char *dataB = dataR + ofsB;
-      int x, y, pos;
-      if(subsample) {
-         for(y = 0; y < height; y += 16) {
-            for(x = 0; x < width; x += 16) {
-               float Y[256], U[256], V[256];
-               for(row = y, pos = 0; row < y+16; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+16; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
+      int mcu = subsample ? 16 : 8;
+      int mcus = (width + mcu - 1) / mcu;
+      // whole groups of 8 blocks in every plane, the halved chroma included
+      int yw = (mcus*mcu + (subsample ? 127 : 63)) & ~(subsample ? 127 : 63);
+      int cw = subsample ? yw/2 : yw;
+      int ygroups = yw/64, cgroups = cw/64;
+      size_t yplane = (size_t)mcu*yw, cplane = (size_t)8*cw;
+      size_t ycoefs = (size_t)ygroups*(mcu/8)*512, ccoefs = (size_t)cgroups*512;
+      float *Yp, *Up, *Vp, *Us, *Vs, *Uc, *Vc;
+      short *qY, *qU, *qV;
+      void *mem;
+      stbiw__jpg_bitwriter bw;
+      int x, y, m, g;
+      void (*rgb_row)(float *, float *, float *, const unsigned char *, int, int) = stbiw__jpg_rgb_row;
+      void (*quantize8)(float *, int, const float *, short *) = stbiw__jpg_quantize8;
+
+#ifdef STBIW__AVX_DISPATCH
+      if(__builtin_cpu_supports("avx2")) {
+         rgb_row = stbiw__jpg_rgb_row_avx2;
+         quantize8 = stbiw__jpg_quantize8_avx2;
+      }
+#endif
+
+      mem = STBIW_MALLOC((3*yplane + 2*cplane)*sizeof(float) + (ycoefs + 2*ccoefs)*sizeof(short));
+      if(!mem) {
+         return 0;
+      }
+      Yp = (float *) mem;
+      Up = Yp + yplane;
+      Vp = Up + yplane;
+      Us = Vp + yplane;
+      Vs = Us + cplane;
+      Uc = subsample ? Us : Up;
+      Vc = subsample ? Vs : Vp;
+      qY = (short *) (Vs + cplane);
+      qU = qY + ycoefs;
+      qV = qU + ccoefs;
+      bw.s = s;
+      bw.acc = 0;
+      bw.bits = 0;
+      bw.used = 0;
+
+      for(y = 0; y < height; y += mcu) {
+         for(row = 0; row < mcu; ++row) {
+            // row >= height => use last input row
+            int clamped_row = (y+row < height) ? y+row : height - 1;
+            int src_row = stbi__flip_vertically_on_write ? height-1-clamped_row : clamped_row;
+            float *Yr = Yp + row*yw, *Ur = Up + row*yw, *Vr = Vp + row*yw;
+            if(planes) {
+               stbiw__jpg_plane_row(Yr, planes[0] + (size_t)src_row*strides[0], width, yw);
+               if(!subsample) {
+                  stbiw__jpg_plane_row(Ur, planes[1] + (size_t)src_row*strides[1], width, yw);
+                  stbiw__jpg_plane_row(Vr, planes[2] + (size_t)src_row*strides[2], width, yw);
                }
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+0,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+8,   16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+128, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y+136, 16, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-
-               // subsample U,V
-               {
-                  float subU[64], subV[64];
-                  int yy, xx;
-                  for(yy = 0, pos = 0; yy < 8; ++yy) {
-                     for(xx = 0; xx < 8; ++xx, ++pos) {
-                        int j = yy*32+xx*2;
-                        subU[pos] = (U[j+0] + U[j+1] + U[j+16] + U[j+17]) * 0.25f;
-                        subV[pos] = (V[j+0] + V[j+1] + V[j+16] + V[j+17]) * 0.25f;
-                     }
-                  }
-                  DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subU, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-                  DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, subV, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
+            } else {
+               rgb_row(Yr, Ur, Vr, (const unsigned char *) data + (size_t)src_row*width*comp, width, comp);
+               // col >= width => use pixel from last input column
+               for(col = width; col < yw; ++col) {
+                  Yr[col] = Yr[width-1];
+                  Ur[col] = Ur[width-1];
+                  Vr[col] = Vr[width-1];
                }
             }
          }
-      } else {
-         for(y = 0; y < height; y += 8) {
-            for(x = 0; x < width; x += 8) {
-               float Y[64], U[64], V[64];
-               for(row = y, pos = 0; row < y+8; ++row) {
-                  // row >= height => use last input row
-                  int clamped_row = (row < height) ? row : height - 1;
-                  int base_p = (stbi__flip_vertically_on_write ? (height-1-clamped_row) : clamped_row)*width*comp;
-                  for(col = x; col < x+8; ++col, ++pos) {
-                     // if col >= width => use pixel from last input column
-                     int p = base_p + ((col < width) ? col : (width-1))*comp;
-                     float r = dataR[p], g = dataG[p], b = dataB[p];
-                     Y[pos]= +0.29900f*r + 0.58700f*g + 0.11400f*b - 128;
-                     U[pos]= -0.16874f*r - 0.33126f*g + 0.50000f*b;
-                     V[pos]= +0.50000f*r - 0.41869f*g - 0.08131f*b;
-                  }
+
+         if(subsample && planes) {
+            // chroma planes arrive already subsampled
+            int ch = (height+1)/2, cwidth = (width+1)/2;
+            for(row = 0; row < 8; ++row) {
+               int clamped_row = (y/2+row < ch) ? y/2+row : ch - 1;
+               int src_row = stbi__flip_vertically_on_write ? ch-1-clamped_row : clamped_row;
+               stbiw__jpg_plane_row(Us + row*cw, planes[1] + (size_t)src_row*strides[1], cwidth, cw);
+               stbiw__jpg_plane_row(Vs + row*cw, planes[2] + (size_t)src_row*strides[2], cwidth, cw);
+            }
+         } else if(subsample) {
+            // subsample U,V
+            for(row = 0; row < 8; ++row) {
+               const float *u0 = Up + 2*row*yw, *u1 = u0 + yw;
+               const float *v0 = Vp + 2*row*yw, *v1 = v0 + yw;
+               float *us = Us + row*cw, *vs = Vs + row*cw;
+               for(x = 0; x < cw; ++x) {
+                  us[x] = (u0[2*x] + u0[2*x+1] + u1[2*x] + u1[2*x+1]) * 0.25f;
+                  vs[x] = (v0[2*x] + v0[2*x+1] + v1[2*x] + v1[2*x+1]) * 0.25f;
                }
+            }
+         }
 
-               DCY = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, Y, 8, fdtbl_Y,  DCY, YDC_HT, YAC_HT);
-               DCU = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, U, 8, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-               DCV = stbiw__jpg_processDU(s, &bitBuf, &bitCnt, V, 8, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
+         for(row = 0; row < mcu/8; ++row) {
+            for(g = 0; g < ygroups; ++g) {
+               quantize8(Yp + row*8*yw + g*64, yw, fdtbl_Y, qY + ((size_t)row*ygroups + g)*512);
             }
          }
+         for(g = 0; g < cgroups; ++g) {
+            quantize8(Uc + g*64, cw, fdtbl_UV, qU + (size_t)g*512);
+            quantize8(Vc + g*64, cw, fdtbl_UV, qV + (size_t)g*512);
+         }
+
+         // block x of block row r of a plane with `groups` groups per row
+         #define STBIW__JPG_BLOCK(q, groups, r, x) ((q) + ((size_t)(r)*(groups) + (x)/8)*512 + (x)%8)
+         for(m = 0; m < mcus; ++m) {
+            if(subsample) {
+               DCY = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qY, ygroups, 0, 2*m),   8, DCY, YDC_HT, YAC_HT);
+               DCY = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qY, ygroups, 0, 2*m+1), 8, DCY, YDC_HT, YAC_HT);
+               DCY = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qY, ygroups, 1, 2*m),   8, DCY, YDC_HT, YAC_HT);
+               DCY = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qY, ygroups, 1, 2*m+1), 8, DCY, YDC_HT, YAC_HT);
+            } else {
+               DCY = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qY, ygroups, 0, m), 8, DCY, YDC_HT, YAC_HT);
+            }
+            DCU = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qU, cgroups, 0, m), 8, DCU, UVDC_HT, UVAC_HT);
+            DCV = stbiw__jpg_encodeDU(&bw, STBIW__JPG_BLOCK(qV, cgroups, 0, m), 8, DCV, UVDC_HT, UVAC_HT);
+         }
+         #undef STBIW__JPG_BLOCK
       }
 
-      // Do the bit alignment of the EOI marker
-      stbiw__jpg_writeBits(s, &bitBuf, &bitCnt, fillBits);
+      stbiw__jpg_finishBits(&bw);
+      STBIW_FREE(mem);
    }
 
    // EOI
@@ -1604,11 +2154,25 @@ static int stbi_write_jpg_core(stbi__write_context *s, int width, int height, in
    return 1;
 }
 
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT ON
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
 STBIWDEF int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int quality)
 {
    stbi__write_context s = { 0 };
    stbi__start_write_callbacks(&s, func, context);
-   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, quality);
+   return stbi_write_jpg_core(&s, x, y, comp, (void *) data, NULL, NULL, -1, quality);
+}
+
+STBIWDEF int stbi_write_jpg_ycbcr_to_func(stbi_write_func *func, void *context, int x, int y, const unsigned char *const planes[3], const int strides[3], int subsampled, int quality)
+{
+   stbi__write_context s = { 0 };
+   if (!planes) return 0;
+   stbi__start_write_callbacks(&s, func, context);
+   return stbi_write_jpg_core(&s, x, y, 3, NULL, planes, strides, subsampled ? 1 : 0, quality);
 }
 
 
@@ -1617,7 +2181,7 @@ STBIWDEF int stbi_write_jpg(char const *filename, int x, int y, int comp, const
 {
    stbi__write_context s = { 0 };
    if (stbi__start_write_file(&s,filename)) {
-      int r = stbi_write_jpg_core(&s, x, y, comp, data, quality);
+      int r = stbi_write_jpg_core(&s, x, y, comp, data, NULL, NULL, -1, quality);
       stbi__end_write_file(&s);
       return r;
    } else
@@ -0,0 +1,314 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include "memory.hpp"
+#include "parallel.hpp"
+#include "resize.hpp"
+#include "utils.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Layout of the frames in a stream: YUV4MPEG2 (planar 8-bit Y, Cb, Cr with the
+// chroma subsampling from its C tag) or headerless interleaved RGB.
+struct FrameFormat {
+  bool y4m{false};
+  int cols{0}, rows{0};
+  int chroma_step_cols{1}, chroma_step_rows{1};
+  // Subsampled chroma columns sit on the even luma columns (C420, C420mpeg2,
+  // C422) rather than centred between them (C420jpeg); rows are centred.
+  bool chroma_cosited{false};
+  std::vector<std::string> tags; // other Y4M stream tags, passed through
+
+  YCbCrImage planes(unsigned char *data) const {
+    return YCbCrImage{cols, rows, chroma_step_cols, chroma_step_rows, data};
+  }
+  size_t frame_bytes() const {
+    return y4m ? planes(nullptr).size()
+               : static_cast<size_t>(cols) * rows * kChannels;
+  }
+};
+
+// Reads the "YUV4MPEG2 W.. H.. C.. ..." stream header. Only 8-bit 4:2:0, 4:2:2
+// and 4:4:4 are supported. C420paldv is refused: its Cb and Cr are sited on
+// different rows, which one set of chroma tables cannot follow.
+static bool ReadY4MHeader(FILE *in, FrameFormat *format) {
+  std::string line;
+  for (int c; (c = getc(in)) != EOF && c != '\n';)
+    line.push_back(c);
+  std::istringstream fields(line);
+  std::string tag;
+  if (!(fields >> tag) || tag != "YUV4MPEG2")
+    return false;
+  format->y4m = true;
+  // no C tag means C420jpeg
+  format->chroma_step_cols = format->chroma_step_rows = 2;
+  format->chroma_cosited = false;
+  while (fields >> tag) {
+    if (tag[0] == 'W') {
+      format->cols = atoi(tag.c_str() + 1);
+    } else if (tag[0] == 'H') {
+      format->rows = atoi(tag.c_str() + 1);
+    } else if (tag[0] == 'C') {
+      if (tag == "C420" || tag == "C420jpeg" || tag == "C420mpeg2") {
+        format->chroma_step_cols = format->chroma_step_rows = 2;
+        format->chroma_cosited = tag != "C420jpeg";
+      } else if (tag == "C422") {
+        format->chroma_step_cols = 2;
+        format->chroma_step_rows = 1;
+        format->chroma_cosited = true;
+      } else if (tag == "C444") {
+        format->chroma_step_cols = format->chroma_step_rows = 1;
+      } else {
+        std::cerr << "unsupported Y4M color space " << tag << std::endl;
+        return false;
+      }
+      format->tags.push_back(tag);
+    } else {
+      format->tags.push_back(tag);
+    }
+  }
+  return format->cols > 0 && format->rows > 0;
+}
+
+// Resizes frames of one format by a fixed ratio. The weight tables are built
+// once for the stream, and each frame is one ParallelStripes pass over the
+// rows of all of its planes.
+class FrameResizer {
+public:
+  FrameResizer(const FrameFormat &in, float ratio) : in_(in), out_(in) {
+    out_.rows = in.rows * ratio;
+    out_.cols = in.cols * ratio;
+    if (in.y4m) {
+      BuildAxisWeights(in.rows, out_.rows, ratio, in.cols, &luma_.rows);
+      BuildAxisWeights(in.cols, out_.cols, ratio, 1, &luma_.cols);
+      // the output keeps the input's siting, so centred chroma is shifted to
+      // stay on the luma it covers while cosited chroma needs no shift
+      YCbCrImage src = in.planes(nullptr), dst = out_.planes(nullptr);
+      const int step_rows = in.chroma_step_rows, step_cols = in.chroma_step_cols;
+      BuildAxisWeights(src.chroma_rows(), dst.chroma_rows(), ratio,
+                       src.chroma_cols(), &chroma_.rows, 0, 0, false,
+                       ChromaShift(ratio, step_rows, step_rows));
+      BuildAxisWeights(src.chroma_cols(), dst.chroma_cols(), ratio, 1,
+                       &chroma_.cols, 0, 0, false,
+                       in.chroma_cosited
+                           ? 0
+                           : ChromaShift(ratio, step_cols, step_cols));
+    } else {
+      RGBImage src{in.cols, in.rows, kChannels, nullptr};
+      BuildResizeTables(src, ratio, &luma_);
+    }
+  }
+
+  const FrameFormat &output() const { return out_; }
+
+  void Resize(const unsigned char *in, unsigned char *out) const {
+    if (!in_.y4m) {
+      const size_t stride = static_cast<size_t>(out_.cols) * kChannels;
+      ParallelStripes(out_.rows, [&](int, int begin, int end) {
+        ResizeRegion(in, luma_.rows, luma_.cols, begin, end, 0, out_.cols,
+                     out + begin * stride, stride);
+      });
+      return;
+    }
+    YCbCrImage src = in_.planes(const_cast<unsigned char *>(in));
+    YCbCrImage dst = out_.planes(out);
+    const int luma_rows = dst.rows, chroma_rows = dst.chroma_rows();
+    ParallelStripes(luma_rows + 2 * chroma_rows, [&](int, int begin, int end) {
+      // rows [0, luma_rows) are Y, then Cb, then Cr
+      for (int k = 0; k < 3 && begin < end; k++) {
+        const int first = k == 0 ? 0 : luma_rows + (k - 1) * chroma_rows;
+        const int count = k == 0 ? luma_rows : chroma_rows;
+        if (begin >= first + count)
+          continue;
+        const int row_end = std::min(end, first + count);
+        const ResizeTables &tables = k == 0 ? luma_ : chroma_;
+        const int cols = k == 0 ? dst.cols : dst.chroma_cols();
+        ResizeRegion<1>(src.plane(k), tables.rows, tables.cols, begin - first,
+                        row_end - first, 0, cols,
+                        dst.plane(k) + static_cast<size_t>(begin - first) * cols,
+                        cols);
+        begin = row_end;
+      }
+    });
+  }
+
+private:
+  FrameFormat in_, out_;
+  ResizeTables luma_, chroma_; // luma_ holds the RGB tables for raw streams
+};
+
+// Hands frame slot numbers from one pipeline stage to the next.
+class SlotQueue {
+public:
+  void Push(int slot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slots_.push_back(slot);
+    ready_.notify_one();
+  }
+
+  // Ends the stream once the queued slots are drained.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    ready_.notify_all();
+  }
+
+  // False once the queue is closed and empty.
+  bool Pop(int *slot) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_.wait(lock, [&] { return !slots_.empty() || closed_; });
+    if (slots_.empty())
+      return false;
+    *slot = slots_.front();
+    slots_.pop_front();
+    return true;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<int> slots_;
+  bool closed_{false};
+};
+
+// Resizes every frame of a Y4M stream, or of a raw RGB stream when `raw` has
+// a frame size, from `src` to `dst` ("-" for stdin / stdout). Reading, resizing
+// and writing run on separate threads and overlap across consecutive frames,
+// through a few frame buffers on each side that are allocated once, so with
+// the resize spread over the workers the stream moves at close to memory
+// speed. Progress goes to stderr since stdout may carry the frames.
+bool ResizeFrameStream(const std::string &src, const std::string &dst,
+                       float ratio, FrameFormat raw = FrameFormat()) {
+  FILE *in = src == "-" ? stdin : fopen(src.c_str(), "rb");
+  if (!in) {
+    std::cerr << "error opening " << src << std::endl;
+    return false;
+  }
+  FrameFormat format = raw;
+  if (raw.cols <= 0 && !ReadY4MHeader(in, &format)) {
+    std::cerr << "not a supported Y4M stream: " << src << std::endl;
+    if (in != stdin)
+      fclose(in);
+    return false;
+  }
+  FILE *out = dst == "-" ? stdout : fopen(dst.c_str(), "wb");
+  if (!out) {
+    std::cerr << "error opening " << dst << std::endl;
+    if (in != stdin)
+      fclose(in);
+    return false;
+  }
+
+  FrameResizer resizer(format, ratio);
+  const FrameFormat &out_format = resizer.output();
+  std::cerr << "resize " << format.cols << "x" << format.rows << " frames to "
+            << out_format.cols << "x" << out_format.rows << std::endl;
+  bool succ = true;
+  if (format.y4m) {
+    std::string header = "YUV4MPEG2 W" + std::to_string(out_format.cols) +
+                         " H" + std::to_string(out_format.rows);
+    for (const auto &tag : format.tags)
+      header += " " + tag;
+    header += "\n";
+    succ = fwrite(header.data(), 1, header.size(), out) == header.size();
+  }
+
+  // one slot being filled, one resized and one written on each side, plus a
+  // spare to absorb jitter
+  const int kSlots = 4;
+  const size_t in_bytes = format.frame_bytes();
+  const size_t out_bytes = out_format.frame_bytes();
+  std::vector<unsigned char *> inputs, outputs;
+  SlotQueue free_inputs, read, free_outputs, resized;
+  for (int k = 0; k < kSlots; k++) {
+    inputs.push_back(AllocImageBuffer(in_bytes));
+    outputs.push_back(AllocImageBuffer(out_bytes));
+    succ = succ && inputs.back() && outputs.back();
+    free_inputs.Push(k);
+    free_outputs.Push(k);
+  }
+
+  bool read_failed = false;
+  std::thread reader([&] {
+    int slot;
+    while (succ && free_inputs.Pop(&slot)) {
+      if (format.y4m) {
+        // "FRAME" and optional parameters up to the newline
+        int c = getc(in);
+        if (c == EOF)
+          break;
+        while (c != EOF && c != '\n')
+          c = getc(in);
+      }
+      size_t n = fread(inputs[slot], 1, in_bytes, in);
+      if (n != in_bytes) {
+        read_failed = n != 0 || format.y4m;
+        break;
+      }
+      read.Push(slot);
+    }
+    read.Close();
+  });
+
+  bool write_failed = false;
+  std::thread writer([&] {
+    static const char kFrame[] = "FRAME\n";
+    int slot;
+    while (resized.Pop(&slot)) {
+      if (!write_failed) {
+        write_failed =
+            (format.y4m && fwrite(kFrame, 1, sizeof(kFrame) - 1, out) !=
+                               sizeof(kFrame) - 1) ||
+            fwrite(outputs[slot], 1, out_bytes, out) != out_bytes;
+      }
+      free_outputs.Push(slot);
+    }
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  int frames = 0;
+  int in_slot, out_slot;
+  while (read.Pop(&in_slot) && free_outputs.Pop(&out_slot)) {
+    resizer.Resize(inputs[in_slot], outputs[out_slot]);
+    free_inputs.Push(in_slot);
+    resized.Push(out_slot);
+    frames++;
+  }
+  free_inputs.Close();
+  resized.Close();
+  reader.join();
+  writer.join();
+  free_outputs.Close();
+
+  if (fflush(out) != 0)
+    write_failed = true;
+  if (in != stdin)
+    fclose(in);
+  if (out != stdout && fclose(out) != 0)
+    write_failed = true;
+  for (int k = 0; k < kSlots; k++) {
+    FreeImageBuffer(inputs[k]);
+    FreeImageBuffer(outputs[k]);
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "resized " << frames << " frames in " << elapsed.count() * 1000
+            << "ms (" << frames / elapsed.count() << " fps, "
+            << frames * (in_bytes + out_bytes) / 1048576.0 / elapsed.count()
+            << " MB/s)" << std::endl;
+  if (read_failed)
+    std::cerr << "error reading " << src << ": truncated frame" << std::endl;
+  if (write_failed)
+    std::cerr << "error writing " << dst << std::endl;
+  return succ && !read_failed && !write_failed;
+}
+
+#endif
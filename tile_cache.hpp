@@ -0,0 +1,229 @@
+#ifndef TILE_CACHE_H_
+#define TILE_CACHE_H_
+
+#include "memory.hpp"
+#include "resize.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+// One computed tile of a resized image; the pixels go with the last reference.
+struct CachedTile {
+  RGBImage pixels{0, 0, kChannels, nullptr};
+
+  CachedTile() = default;
+  CachedTile(const CachedTile &) = delete;
+  CachedTile &operator=(const CachedTile &) = delete;
+  ~CachedTile() { FreeImageBuffer(pixels.data); }
+
+  size_t bytes() const {
+    return static_cast<size_t>(pixels.cols) * pixels.rows * pixels.channels;
+  }
+};
+
+// Serves tiles of upscaled images for interactive zooming. A tile is only
+// computed when it is first asked for, from weight tables built once per
+// (image, scale), and then kept in an LRU list bounded by `max_bytes` of
+// pixels. Callers asking for a tile that another thread is still computing
+// wait for that result instead of computing it again. Tiles handed out stay
+// valid after eviction for as long as the caller holds them. Thread safe.
+class TileCache {
+public:
+  typedef std::shared_ptr<const CachedTile> TilePtr;
+
+  explicit TileCache(size_t max_bytes, int tile_size = 256)
+      : max_bytes_(max_bytes), tile_size_(tile_size) {}
+
+  TileCache(const TileCache &) = delete;
+  TileCache &operator=(const TileCache &) = delete;
+
+  // Registers a source image; its pixels are not copied and have to stay valid
+  // until RemoveImage returns.
+  uint64_t AddImage(const RGBImage &src) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = ++last_id_;
+    images_.emplace(id, src);
+    return id;
+  }
+
+  // Forgets an image, its weight tables and its cached tiles. Tiles of it
+  // still being computed are waited for (and not kept), so its pixels can be
+  // freed as soon as this returns.
+  void RemoveImage(uint64_t id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    images_.erase(id);
+    computed_.wait(lock, [&] { return !computing_.count(id); });
+    for (auto it = tables_.begin(); it != tables_.end();) {
+      if (std::get<0>(it->first) == id)
+        it = tables_.erase(it);
+      else
+        ++it;
+    }
+    for (auto it = tiles_.begin(); it != tiles_.end();) {
+      if (std::get<0>(it->first) == id) {
+        bytes_ -= it->second.bytes;
+        lru_.erase(it->second.lru);
+        it = tiles_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Tile (x, y) of image `id` resized by `scale`: the tile_size square whose
+  // top left output pixel is (y * tile_size, x * tile_size), clipped at the
+  // right and bottom edges. nullptr for unknown images or tiles outside the
+  // output.
+  TilePtr Get(uint64_t id, float scale, int x, int y) {
+    const TileKey key(id, scale, x, y);
+    std::shared_future<TilePtr> pending;
+    std::promise<TilePtr> promise;
+    std::shared_ptr<const ResizeTables> tables;
+    RGBImage src;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = tiles_.find(key);
+      if (it != tiles_.end()) {
+        if (it->second.ready)
+          lru_.splice(lru_.begin(), lru_, it->second.lru);
+        pending = it->second.tile;
+      } else {
+        auto image = images_.find(id);
+        if (image == images_.end())
+          return nullptr;
+        src = image->second;
+        tables = TablesFor(id, src, scale);
+        if (x < 0 || y < 0 || x * tile_size_ >= tables->resize_cols ||
+            y * tile_size_ >= tables->resize_rows)
+          return nullptr;
+        Entry &entry = tiles_[key];
+        entry.tile = promise.get_future().share();
+        pending = entry.tile;
+        computing_[id]++;
+      }
+    }
+    if (!tables)
+      return pending.get(); // cached, or coalesced with the thread computing it
+
+    std::shared_ptr<CachedTile> tile;
+    try {
+      tile = std::make_shared<CachedTile>();
+      ComputeTile(src, *tables, x, y, &tile->pixels);
+    } catch (...) {
+      // drop the entry so the next Get tries again, and hand the error to
+      // the threads waiting on this one
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tiles_.erase(key);
+        DoneComputing(id);
+      }
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      DoneComputing(id);
+      auto it = tiles_.find(key);
+      if (!images_.count(id) || !tile->pixels.data) {
+        tiles_.erase(it); // removed meanwhile or out of memory: don't keep it
+      } else {
+        it->second.ready = true;
+        it->second.bytes = tile->bytes();
+        lru_.push_front(key);
+        it->second.lru = lru_.begin();
+        bytes_ += it->second.bytes;
+        Evict();
+      }
+    }
+    TilePtr result = tile->pixels.data ? tile : nullptr;
+    promise.set_value(result);
+    return result;
+  }
+
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+private:
+  typedef std::tuple<uint64_t, float, int, int> TileKey;
+
+  struct Entry {
+    std::shared_future<TilePtr> tile;
+    bool ready{false}; // only ready tiles are in the LRU list
+    size_t bytes{0};
+    std::list<TileKey>::iterator lru;
+  };
+
+  std::shared_ptr<const ResizeTables> TablesFor(uint64_t id,
+                                                const RGBImage &src,
+                                                float scale) {
+    auto &tables = tables_[std::make_tuple(id, scale)];
+    if (!tables) {
+      auto built = std::make_shared<ResizeTables>();
+      BuildResizeTables(src, scale, built.get());
+      tables = built;
+    }
+    return tables;
+  }
+
+  void DoneComputing(uint64_t id) {
+    auto it = computing_.find(id);
+    if (--it->second == 0) {
+      computing_.erase(it);
+      computed_.notify_all();
+    }
+  }
+
+  // Same kernel as ResizeImagePart, writing into a standalone tile buffer
+  // instead of the whole output image.
+  void ComputeTile(const RGBImage &src, const ResizeTables &tables, int x,
+                   int y, RGBImage *tile) const {
+    const int row_begin = y * tile_size_;
+    const int row_end = std::min(row_begin + tile_size_, tables.resize_rows);
+    const int col_begin = x * tile_size_;
+    const int col_end = std::min(col_begin + tile_size_, tables.resize_cols);
+    tile->cols = col_end - col_begin;
+    tile->rows = row_end - row_begin;
+    const size_t stride = static_cast<size_t>(tile->cols) * kChannels;
+    tile->data = AllocImageBuffer(stride * tile->rows);
+    if (tile->data) {
+      ResizeRegion(src.data, tables.rows, tables.cols, row_begin, row_end,
+                   col_begin, col_end, tile->data, stride);
+    }
+  }
+
+  // Drops least recently used tiles until the budget holds again; the most
+  // recent one always stays.
+  void Evict() {
+    while (bytes_ > max_bytes_ && lru_.size() > 1) {
+      auto it = tiles_.find(lru_.back());
+      bytes_ -= it->second.bytes;
+      tiles_.erase(it);
+      lru_.pop_back();
+    }
+  }
+
+  const size_t max_bytes_;
+  const int tile_size_;
+  mutable std::mutex mutex_;
+  uint64_t last_id_{0};
+  std::map<uint64_t, RGBImage> images_;
+  std::map<uint64_t, int> computing_; // tiles in flight per image
+  std::condition_variable computed_;  // a computing_ count dropped to zero
+  std::map<std::tuple<uint64_t, float>, std::shared_ptr<const ResizeTables>>
+      tables_;
+  std::map<TileKey, Entry> tiles_;
+  std::list<TileKey> lru_; // front is the most recently used
+  size_t bytes_{0};
+};
+
+#endif
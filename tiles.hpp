@@ -0,0 +1,164 @@
+#ifndef TILES_H_
+#define TILES_H_
+
+#include "image.hpp"
+#include "parallel.hpp"
+#include "pyramid.hpp"
+#include "resize.hpp"
+#include "utils.hpp"
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+enum class TileLayout {
+  kDeepZoom, // <base>.dzi + <base>_files/<level>/<col>_<row>.jpg
+  kXYZ,      // <base>/<z>/<x>/<y>.jpg, z = 0 is the first level in one tile
+};
+
+struct TileOptions {
+  int tile_size{256};
+  int overlap{0}; // DZI overlap, pixels added on each inner edge
+  int quality{95};
+  TileLayout layout{TileLayout::kDeepZoom};
+};
+
+// One level of the output pyramid and where its pixels are sampled from.
+struct TileLevel {
+  int level;
+  int rows, cols;
+  const RGBImage *base;
+  ResizeTables tables;
+  std::string dir;
+};
+
+// Cuts the `ratio` times resized image into a tile pyramid on disk without
+// ever holding more than one tile per worker in memory. Every level is
+// resampled from the source, or for reductions from the source mip level just
+// above it so small levels do not alias, and each tile is computed and
+// JPEG-encoded independently on the worker threads.
+bool ResizeImageToTiles(const RGBImage &src, float ratio,
+                        const std::string &base,
+                        const TileOptions &options = TileOptions()) {
+  Timer timer("resize image to tiles");
+  const int size = options.tile_size;
+  const int full_rows = src.rows * ratio;
+  const int full_cols = src.cols * ratio;
+  const int max_level =
+      static_cast<int>(ceil(log2(std::max(std::max(full_rows, full_cols), 1))));
+
+  // DZI level sizes halve with rounding up, level 0 is 1x1
+  auto level_dim = [&](int full, int level) {
+    int shift = max_level - level;
+    return (full + (1 << shift) - 1) >> shift;
+  };
+  int first_level = 0;
+  if (options.layout == TileLayout::kXYZ) {
+    while (first_level < max_level &&
+           std::max(level_dim(full_rows, first_level + 1),
+                    level_dim(full_cols, first_level + 1)) <= size)
+      first_level++;
+  }
+
+  ImagePyramid mips = BuildPyramid(src);
+  std::vector<TileLevel> levels;
+  for (int level = first_level; level <= max_level; level++) {
+    TileLevel tl{level, level_dim(full_rows, level), level_dim(full_cols, level),
+                 &src, {}, ""};
+    if (level == max_level) {
+      BuildResizeTables(src, ratio, &tl.tables);
+    } else {
+      // sample from the smallest mip that is still at least as large
+      for (const auto &mip : mips.levels) {
+        if (mip.rows >= tl.rows && mip.cols >= tl.cols)
+          tl.base = &mip;
+      }
+      tl.tables.resize_rows = tl.rows;
+      tl.tables.resize_cols = tl.cols;
+      BuildAxisWeights(tl.base->rows, tl.rows, float(tl.rows) / tl.base->rows,
+                       tl.base->cols * kChannels, &tl.tables.rows);
+      BuildAxisWeights(tl.base->cols, tl.cols, float(tl.cols) / tl.base->cols,
+                       kChannels, &tl.tables.cols);
+    }
+    levels.push_back(tl);
+  }
+
+  // directories first, tiles are written concurrently
+  if (options.layout == TileLayout::kDeepZoom) {
+    std::ofstream dzi(base + ".dzi");
+    dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+        << "Format=\"jpg\" Overlap=\"" << options.overlap << "\" TileSize=\""
+        << size << "\">\n  <Size Width=\"" << full_cols << "\" Height=\""
+        << full_rows << "\"/>\n</Image>\n";
+    if (!dzi) {
+      std::cerr << "error saving " << base << ".dzi" << std::endl;
+      FreePyramid(&mips);
+      return false;
+    }
+    mkdir((base + "_files").c_str(), 0755);
+    for (auto &tl : levels) {
+      tl.dir = base + "_files/" + std::to_string(tl.level) + "/";
+      mkdir(tl.dir.c_str(), 0755);
+    }
+  } else {
+    mkdir(base.c_str(), 0755);
+    for (auto &tl : levels) {
+      tl.dir = base + "/" + std::to_string(tl.level - first_level) + "/";
+      mkdir(tl.dir.c_str(), 0755);
+      for (int x = 0; x * size < tl.cols; x++)
+        mkdir((tl.dir + std::to_string(x)).c_str(), 0755);
+    }
+  }
+
+  struct Tile {
+    const TileLevel *level;
+    int x, y;
+  };
+  std::vector<Tile> tiles;
+  for (const auto &tl : levels) {
+    for (int y = 0; y * size < tl.rows; y++)
+      for (int x = 0; x * size < tl.cols; x++)
+        tiles.push_back(Tile{&tl, x, y});
+  }
+
+  std::atomic<bool> succ{true};
+  ParallelStripes(static_cast<int>(tiles.size()), [&](int, int begin, int end) {
+    const int span = size + 2 * options.overlap;
+    std::vector<unsigned char> pixels(static_cast<size_t>(span) * span *
+                                      kChannels);
+    for (int t = begin; t < end; t++) {
+      const TileLevel &tl = *tiles[t].level;
+      int row_begin = std::max(tiles[t].y * size - options.overlap, 0);
+      int row_end = std::min((tiles[t].y + 1) * size + options.overlap, tl.rows);
+      int col_begin = std::max(tiles[t].x * size - options.overlap, 0);
+      int col_end = std::min((tiles[t].x + 1) * size + options.overlap, tl.cols);
+      const size_t stride = static_cast<size_t>(col_end - col_begin) * kChannels;
+      ResizeRegion(tl.base->data, tl.tables.rows, tl.tables.cols, row_begin,
+                   row_end, col_begin, col_end, pixels.data(), stride);
+
+      std::string name =
+          options.layout == TileLayout::kDeepZoom
+              ? tl.dir + std::to_string(tiles[t].x) + "_" +
+                    std::to_string(tiles[t].y) + ".jpg"
+              : tl.dir + std::to_string(tiles[t].x) + "/" +
+                    std::to_string(tiles[t].y) + ".jpg";
+      BufferedFileWriter writer(name, false, 1 << 20);
+      bool ok = writer.ok() &&
+                stbi_write_jpg_to_func(BufferedFileWriter::Write, &writer,
+                                       col_end - col_begin, row_end - row_begin,
+                                       kChannels, pixels.data(),
+                                       options.quality);
+      if (!(writer.Close() && ok))
+        succ = false;
+    }
+  });
+  FreePyramid(&mips);
+  if (!succ)
+    std::cerr << "error saving tiles under " << base << std::endl;
+  return succ;
+}
+
+#endif
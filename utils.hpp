@@ -2,8 +2,12 @@
 #define UTILS_H_
 
 #include <chrono>
+#include <fcntl.h>
 #include <iostream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 class Timer {
@@ -25,9 +29,78 @@ private:
 };
 
 
+// Read-only mapping of a whole file, unmapped when it goes out of scope.
+// The pages are advised for sequential access so the kernel reads ahead
+// aggressively while the decoder walks through them.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        data_ = static_cast<unsigned char *>(addr);
+        size_ = st.st_size;
+        madvise(addr, size_, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_)
+      munmap(data_, size_);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool valid() const { return data_ != nullptr; }
+  const unsigned char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  unsigned char *data_{nullptr};
+  size_t size_{0};
+};
+
+
 struct RGBImage {
   int cols, rows, channels;
   unsigned char *data;
 };
 
+// JPEG style planar YCbCr in one allocation: the Y plane followed by Cb and
+// Cr, all tightly packed. Each chroma sample covers chroma_step_cols x
+// chroma_step_rows luma samples (2 x 2 for 4:2:0, 1 x 1 for 4:4:4).
+struct YCbCrImage {
+  int cols, rows;
+  int chroma_step_cols, chroma_step_rows;
+  unsigned char *data;
+
+  int chroma_cols() const {
+    return (cols + chroma_step_cols - 1) / chroma_step_cols;
+  }
+  int chroma_rows() const {
+    return (rows + chroma_step_rows - 1) / chroma_step_rows;
+  }
+  size_t luma_size() const { return static_cast<size_t>(cols) * rows; }
+  size_t chroma_size() const {
+    return static_cast<size_t>(chroma_cols()) * chroma_rows();
+  }
+  size_t size() const { return luma_size() + 2 * chroma_size(); }
+  // plane 0 is Y, 1 is Cb, 2 is Cr
+  unsigned char *plane(int k) const {
+    return data + (k == 0 ? 0 : luma_size() + (k - 1) * chroma_size());
+  }
+};
+
+// A rectangle of pixels, top left corner at (row, col).
+struct ImageRect {
+  int row, col, rows, cols;
+};
+
 #endif
\ No newline at end of file